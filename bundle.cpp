@@ -0,0 +1,341 @@
+#include "bundle.hpp"
+#include "httpserver.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+
+namespace {
+    const char bundle_magic[8] = {'H', 'T', 'T', 'P', 'B', 'N', 'D', 'L'};
+    const uint32_t bundle_version = 1;
+    const size_t page_size = 4096;
+
+    // 文件中的结构都是小端、定长的; 字符串和数据用 (偏移, 长度) 表示, 偏移从文件开头算起
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint32_t slots;             // 哈希表大小, 2 的幂, 至少是 count 的两倍
+        uint32_t reserved;
+        uint64_t entries_offset;
+        uint64_t slots_offset;
+    };
+
+    struct Span {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct FileEntry {
+        uint64_t hash;
+        Span path, content_type, etag, last_modified, headers, gzip_headers, data, gzip;
+    };
+
+    uint64_t fnv1a(std::string_view s) {
+        uint64_t h = 14695981039346656037ull;
+        for (char c : s) {
+            h ^= static_cast<uint8_t>(c);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    std::string read_file(const boost::filesystem::path& path) {
+        std::ifstream in(path.string(), std::ios::binary);
+        if (!in)
+            throw std::runtime_error("could not read " + path.string());
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    std::string http_date(time_t t) {
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char buffer[64];
+        size_t n = strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return std::string(buffer, n);
+    }
+
+    // gzip 格式 (windowBits 31), 压缩后不到原来的 90% 才保留
+    bool gzip(const std::string& in, std::string& out) {
+        if (in.size() < 256)
+            return false;
+        z_stream z{};
+        if (deflateInit2(&z, 9, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        out.resize(deflateBound(&z, in.size()) + 32);
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        z.avail_in = static_cast<uInt>(in.size());
+        z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        z.avail_out = static_cast<uInt>(out.size());
+        int r = deflate(&z, Z_FINISH);
+        out.resize(out.size() - z.avail_out);
+        deflateEnd(&z);
+        return r == Z_STREAM_END && out.size() < in.size() * 9 / 10;
+    }
+
+    bool contains_token(std::string_view list, std::string_view token) {
+        for (size_t pos = list.find(token); pos != std::string_view::npos; pos = list.find(token, pos + 1)) {
+            bool begin = pos == 0 || list[pos - 1] == ' ' || list[pos - 1] == ',';
+            size_t end = pos + token.size();
+            bool finish = end == list.size() || list[end] == ',' || list[end] == ' ' || list[end] == ';';
+            if (begin && finish)
+                return true;
+        }
+        return false;
+    }
+}
+
+AssetBundle::AssetBundle(const std::string& file, bool populate, bool huge_pages) {
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("could not open bundle " + file);
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(FileHeader))) {
+        ::close(fd);
+        throw std::runtime_error("invalid bundle " + file);
+    }
+
+    size_ = st.st_size;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (populate)
+        flags |= MAP_POPULATE;
+#endif
+    void* p = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        throw std::runtime_error("could not map bundle " + file);
+    data_ = static_cast<const char*>(p);
+#ifdef MADV_HUGEPAGE
+    // 文件映射需要内核支持只读文件的透明大页 (CONFIG_READ_ONLY_THP_FOR_FS), 不支持时忽略
+    if (huge_pages)
+        ::madvise(p, size_, MADV_HUGEPAGE);
+#endif
+
+    // 启动时检查一遍所有的偏移, 之后的查找不再检查
+    FileHeader header;
+    memcpy(&header, data_, sizeof(header));
+    auto valid = [this](uint64_t offset, uint64_t size) {
+        return offset <= size_ && size <= size_ - offset;
+    };
+    bool ok = memcmp(header.magic, bundle_magic, sizeof(bundle_magic)) == 0 && header.version == bundle_version &&
+              header.slots > 0 && (header.slots & (header.slots - 1)) == 0 && header.count < header.slots &&
+              header.entries_offset % alignof(FileEntry) == 0 && header.slots_offset % alignof(uint32_t) == 0 &&
+              valid(header.entries_offset, uint64_t(header.count) * sizeof(FileEntry)) &&
+              valid(header.slots_offset, uint64_t(header.slots) * sizeof(uint32_t));
+
+    if (ok) {
+        auto entries = reinterpret_cast<const FileEntry*>(data_ + header.entries_offset);
+        slots_ = reinterpret_cast<const uint32_t*>(data_ + header.slots_offset);
+        mask_ = header.slots - 1;
+        assets_.reserve(header.count);
+        hashes_.reserve(header.count);
+        auto view = [this](const Span& s) { return std::string_view(data_ + s.offset, s.size); };
+        for (uint32_t i = 0; i < header.count && ok; i++) {
+            const FileEntry& e = entries[i];
+            for (const Span* s : {&e.path, &e.content_type, &e.etag, &e.last_modified, &e.headers, &e.gzip_headers, &e.data, &e.gzip})
+                ok = ok && valid(s->offset, s->size);
+            if (!ok)
+                break;
+            Asset asset;
+            asset.path = view(e.path);
+            asset.content_type = view(e.content_type);
+            asset.etag = view(e.etag);
+            asset.last_modified = view(e.last_modified);
+            asset.headers = view(e.headers);
+            asset.gzip_headers = view(e.gzip_headers);
+            asset.data = boost::asio::const_buffer(data_ + e.data.offset, e.data.size);
+            asset.gzip = boost::asio::const_buffer(data_ + e.gzip.offset, e.gzip.size);
+            assets_.push_back(asset);
+            hashes_.push_back(e.hash);
+        }
+        for (uint32_t i = 0; i <= mask_ && ok; i++)
+            ok = slots_[i] <= header.count;
+    }
+
+    if (!ok) {
+        ::munmap(const_cast<char*>(data_), size_);
+        throw std::runtime_error("invalid bundle " + file);
+    }
+}
+
+AssetBundle::~AssetBundle() {
+    ::munmap(const_cast<char*>(data_), size_);
+}
+
+const AssetBundle::Asset* AssetBundle::find(std::string_view path) const {
+    if (!path.empty() && path.front() == '/')
+        path.remove_prefix(1);
+    uint64_t hash = fnv1a(path);
+    for (uint32_t i = hash & mask_; ; i = (i + 1) & mask_) {
+        uint32_t slot = slots_[i];
+        if (slot == 0)
+            return nullptr;
+        if (hashes_[slot - 1] == hash && assets_[slot - 1].path == path)
+            return &assets_[slot - 1];
+    }
+}
+
+void AssetBundle::serve(Response& response, const Request& request, std::pmr::memory_resource& arena) const {
+    const Asset* asset;
+    if (request.path.empty() || request.path.back() == '/') {
+        // 包中只有文件, 目录返回它下面的 index.html
+        std::pmr::string index(request.path, &arena);
+        index += "index.html";
+        asset = find(index);
+    }
+    else if ((asset = find(request.path)) == nullptr) {
+        // 和 FileCache 一样, 目录不带 '/' 时重定向, 页面中的相对路径才能正确解析
+        std::pmr::string index(request.path, &arena);
+        index += "/index.html";
+        if (find(index)) {
+            std::pmr::string location(request.target, &arena);
+            location.insert(std::min(location.find('?'), location.size()), 1, '/');
+            response.status(301).header("Location", location);
+            return;
+        }
+    }
+    if (asset == nullptr) {
+        response.status(404).header("Content-Type", "text/plain");
+        response << "Could not open path " << request.path << std::endl;
+        return;
+    }
+
+    auto& headers = request.header;
+    auto if_none_match = headers.find(http::HeaderMap::key_type("If-None-Match"));
+    if (if_none_match != headers.end() &&
+        (if_none_match->second == "*" || if_none_match->second.find(asset->etag) != std::pmr::string::npos)) {
+        response.status(304).header("ETag", asset->etag).header("Last-Modified", asset->last_modified);
+        return;
+    }
+
+    // 头部是映射中预先格式化好的一段, 和响应体一样直接引用
+    auto accept_encoding = headers.find(http::HeaderMap::key_type("Accept-Encoding"));
+    if (asset->gzip.size() > 0 && accept_encoding != headers.end() && contains_token(accept_encoding->second, "gzip")) {
+        response.header_block(asset->gzip_headers);
+        response.body(shared_from_this(), asset->gzip);
+    }
+    else {
+        response.header_block(asset->headers);
+        if (asset->data.size() > 0)
+            response.body(shared_from_this(), asset->data);
+    }
+}
+
+void AssetBundle::pack(const std::string& dir, const std::string& file) {
+    namespace fs = boost::filesystem;
+    fs::path root(dir);
+    if (!fs::is_directory(root))
+        throw std::runtime_error(dir + " is not a directory");
+
+    struct Item {
+        std::string path, content_type, etag, last_modified, headers, gzip_headers, data, gzip;
+    };
+    std::vector<Item> items;
+    for (fs::recursive_directory_iterator it(root), end; it != end; ++it) {
+        if (!fs::is_regular_file(it->status()))
+            continue;
+        Item item;
+        item.path = fs::relative(it->path(), root).generic_string();
+        item.content_type = std::string(http::mime_type(item.path));
+        item.data = read_file(it->path());
+        char etag[32];
+        snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(fnv1a(item.data)));
+        item.etag = etag;
+        item.last_modified = http_date(fs::last_write_time(it->path()));
+        if (!gzip(item.data, item.gzip))
+            item.gzip.clear();
+        item.headers = "Content-Type: " + item.content_type + "\r\nETag: " + item.etag +
+                       "\r\nLast-Modified: " + item.last_modified + "\r\n";
+        if (!item.gzip.empty()) {
+            item.headers += "Vary: Accept-Encoding\r\n";
+            item.gzip_headers = item.headers + "Content-Encoding: gzip\r\n";
+        }
+        items.push_back(std::move(item));
+    }
+
+    uint32_t slots = 16;
+    while (slots < items.size() * 2)
+        slots *= 2;
+
+    // 布局: 文件头 | 条目 | 哈希表 | 字符串 | 按页对齐的文件内容
+    FileHeader header = {};
+    memcpy(header.magic, bundle_magic, sizeof(bundle_magic));
+    header.version = bundle_version;
+    header.count = static_cast<uint32_t>(items.size());
+    header.slots = slots;
+    header.entries_offset = sizeof(FileHeader);
+    header.slots_offset = header.entries_offset + items.size() * sizeof(FileEntry);
+
+    std::string strings;
+    uint64_t strings_offset = header.slots_offset + uint64_t(slots) * sizeof(uint32_t);
+    auto add_string = [&](const std::string& s) {
+        Span span{strings_offset + strings.size(), s.size()};
+        strings += s;
+        return span;
+    };
+
+    std::vector<FileEntry> entries(items.size());
+    std::vector<uint32_t> table(slots, 0);
+    for (size_t i = 0; i < items.size(); i++) {
+        FileEntry& e = entries[i];
+        e.hash = fnv1a(items[i].path);
+        e.path = add_string(items[i].path);
+        e.content_type = add_string(items[i].content_type);
+        e.etag = add_string(items[i].etag);
+        e.last_modified = add_string(items[i].last_modified);
+        e.headers = add_string(items[i].headers);
+        e.gzip_headers = add_string(items[i].gzip_headers);
+        uint32_t j = e.hash & (slots - 1);
+        while (table[j] != 0)
+            j = (j + 1) & (slots - 1);
+        table[j] = static_cast<uint32_t>(i + 1);
+    }
+
+    auto align = [](uint64_t n) { return (n + page_size - 1) / page_size * page_size; };
+    uint64_t offset = align(strings_offset + strings.size());
+    for (size_t i = 0; i < items.size(); i++) {
+        entries[i].data = {offset, items[i].data.size()};
+        offset = align(offset + items[i].data.size());
+        entries[i].gzip = {offset, items[i].gzip.size()};
+        offset = align(offset + items[i].gzip.size());
+    }
+
+    // 先写临时文件再改名, 正在运行的服务器映射的旧文件不受影响
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(FileEntry));
+        out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(uint32_t));
+        out.write(strings.data(), strings.size());
+        for (size_t i = 0; i < items.size(); i++) {
+            const Span* spans[2] = {&entries[i].data, &entries[i].gzip};
+            const std::string* blobs[2] = {&items[i].data, &items[i].gzip};
+            for (int k = 0; k < 2; k++) {
+                if (blobs[k]->empty())
+                    continue;
+                out.seekp(spans[k]->offset);
+                out.write(blobs[k]->data(), blobs[k]->size());
+            }
+        }
+        // 最后一段按页补齐, 文件大小和布局一致
+        if (offset > 0) {
+            out.seekp(offset - 1);
+            out.put('\0');
+        }
+        if (!out)
+            throw std::runtime_error("could not write " + tmp);
+    }
+    if (::rename(tmp.c_str(), file.c_str()) != 0)
+        throw std::runtime_error("could not rename " + tmp + " to " + file);
+}
@@ -0,0 +1,62 @@
+#ifndef BUNDLE_HPP
+#define	BUNDLE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+
+class Response;
+struct Request;
+
+// 打包好的静态文件
+// tools/pack_bundle 把 web 目录写成一个文件: 路径表 (开放寻址的哈希表)、预先生成的 Content-Type / ETag /
+// Last-Modified、按页对齐的文件内容以及 gzip 压缩后的版本。服务器启动时 mmap 整个文件, 只读,
+// 查找是一次哈希探测, 响应体直接引用映射中的一段, 不拷贝也不读文件
+class AssetBundle : public std::enable_shared_from_this<AssetBundle> {
+public:
+    struct Asset {
+        std::string_view path;              // 相对 web 目录, 不带开头的 '/'
+        std::string_view content_type;
+        std::string_view etag;              // 带引号, 比如 "\"3f2a...\""
+        std::string_view last_modified;
+        std::string_view headers;           // 预先格式化好的 Content-Type、ETag、Last-Modified (和 Vary)
+        std::string_view gzip_headers;      // 同上, 再加上 Content-Encoding: gzip
+        boost::asio::const_buffer data;
+        boost::asio::const_buffer gzip;     // 没有压缩版本时为空
+    };
+
+    // populate: MAP_POPULATE, 启动时把整个文件读进页缓存; huge_pages: 建议内核使用透明大页
+    explicit AssetBundle(const std::string& file, bool populate = false, bool huge_pages = false);
+    ~AssetBundle();
+
+    AssetBundle(const AssetBundle&) = delete;
+    AssetBundle& operator=(const AssetBundle&) = delete;
+
+    // path 是请求的路径, 开头的 '/' 可有可无; 没有时返回空指针
+    const Asset* find(std::string_view path) const;
+
+    size_t size() const { return assets_.size(); }
+
+    // 作为 default_resource_ 的 GET 处理函数: 条件请求返回 304, 客户端接受 gzip 时发送压缩版本;
+    // 以 '/' 结尾的路径返回目录下的 index.html, 不带 '/' 的目录 (打包了 dir/index.html) 重定向到 dir/
+    void serve(Response& response, const Request& request, std::pmr::memory_resource& arena) const;
+
+    // 把 dir 下的所有普通文件打包写入 file, 失败时抛出 std::runtime_error
+    static void pack(const std::string& dir, const std::string& file);
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    const uint32_t* slots_ = nullptr;   // 0 表示空位, 否则为 assets_ 的下标加一
+    uint32_t mask_ = 0;
+    std::vector<Asset> assets_;
+    std::vector<uint64_t> hashes_;
+};
+
+#endif	/* BUNDLE_HPP */
@@ -0,0 +1,294 @@
+#include "cache.hpp"
+
+#include <atomic>
+#include <functional>
+
+ResponseCache::ResponseCache(io_context& io, size_t num_shards, size_t max_entries)
+    : io_(io), shards_(num_shards > 0 ? num_shards : 1),
+    max_entries_per_shard_(std::max<size_t>(1, max_entries / shards_.size())) {
+}
+
+ResponseCache::Handler ResponseCache::wrap(const string& pattern, Handler handler, Rule rule) {
+    auto route = std::make_shared<Route>(Route{std::regex(pattern), std::move(handler), std::move(rule)});
+    auto self = shared_from_this();
+    return [self, route](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+        self->serve(route, response, request, path_match, arena);
+    };
+}
+
+string ResponseCache::make_key(const Rule& rule, const Request& request) const {
+    string key;
+    auto query = request.query();
+    key.reserve(request.method.size() + request.path.size() + query.size() + 16 * rule.vary.size() + 2);
+    key += request.method;
+    key += ' ';
+    key += request.path;
+    if (!query.empty()) {
+        key += '?';
+        key += query;
+    }
+    for (auto& name : rule.vary) {
+        key += '\n';
+        auto it = request.header.find(http::HeaderMap::key_type(name));
+        if (it != request.header.end())
+            key += it->second;
+    }
+    return key;
+}
+
+ResponseCache::Shard& ResponseCache::shard_for(const string& key) {
+    return shards_[std::hash<string>()(key) % shards_.size()];
+}
+
+// 以自己为 ResponseWriter 调用被包装的处理函数, 收集完整的响应以后交给 filled()
+// 处理函数直接填好 Response 返回时在调用它的线程上完成; 异步完成时在它完成的回调中
+class ResponseCache::Fill : public ResponseWriter, public std::enable_shared_from_this<ResponseCache::Fill> {
+public:
+    // 后台重新生成时没有连接, 请求、路径匹配和内存池由 Fill 持有, 直到异步的处理函数完成
+    shared_ptr<Request> request;
+    std::pmr::monotonic_buffer_resource arena;
+    smatch path_match{&arena};
+
+    Fill(shared_ptr<ResponseCache> cache, shared_ptr<Route> route, string key)
+        : cache_(std::move(cache)), route_(std::move(route)), key_(std::move(key)) {}
+
+    void run(const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+        response_.on_defer([this]() -> shared_ptr<ResponseWriter> {
+            return shared_from_this();
+        });
+        try {
+            route_->handler(response_, request, path_match, arena);
+        }
+        catch (const std::exception& e) {
+            std::cerr << "micro_cache " << request.path << ": " << e.what() << std::endl;
+            return complete(false);
+        }
+        if (!response_.deferred()) {
+            response_.on_defer(nullptr);
+            complete(true);
+        }
+    }
+
+    void finish() override {
+        complete(true);
+    }
+
+    void write_head(Handler handler) override {
+        streamed_ = true;
+        done(std::move(handler));
+    }
+
+    void write_body(const_buffer data, Handler handler) override {
+        body_.append(static_cast<const char*>(data.data()), data.size());
+        done(std::move(handler));
+    }
+
+    void end(bool ok) override {
+        complete(ok);
+    }
+
+    any_io_executor get_executor() override {
+        return cache_->io_.get_executor();
+    }
+
+private:
+    shared_ptr<ResponseCache> cache_;
+    shared_ptr<Route> route_;
+    string key_;
+    Response response_;
+    string body_;                   // 流式写入的响应体
+    bool streamed_ = false;
+    std::atomic<bool> completed_{false};
+
+    void done(Handler handler) {
+        bool aborted = completed_;
+        post(cache_->io_, [handler = std::move(handler), aborted]() {
+            handler(aborted ? boost::system::error_code(error::operation_aborted) : boost::system::error_code());
+        });
+    }
+
+    void complete(bool ok) {
+        if (completed_.exchange(true))
+            return;
+        cache_->filled(*route_, key_, ok ? snapshot(response_, streamed_ ? &body_ : nullptr) : nullptr);
+    }
+};
+
+void ResponseCache::serve(const shared_ptr<Route>& route, Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+    string key = make_key(route->rule, request);
+    Shard& shard = shard_for(key);
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(key);
+    auto now = clock::now();
+    if (it != shard.entries.end() && it->second.response) {
+        Entry& entry = it->second;
+        if (now < entry.fresh_until) {
+            auto cached = entry.response;
+            lock.unlock();
+            apply(*cached, response);
+            return;
+        }
+        // 已经过期但还在 stale 时间内: 先返回旧响应, 由第一个看到过期的请求发起后台重新生成
+        if (now < entry.stale_until) {
+            auto cached = entry.response;
+            if (!entry.refreshing) {
+                entry.refreshing = true;
+                lock.unlock();
+                revalidate(route, key, request);
+            }
+            else
+                lock.unlock();
+            apply(*cached, response);
+            return;
+        }
+    }
+
+    // 已经有一次生成在进行: 排队, 由它完成时一起返回
+    if (it != shard.entries.end() && it->second.refreshing) {
+        if (auto writer = response.defer()) {
+            it->second.waiters.push_back({std::move(writer), &response});
+            return;
+        }
+        // 调用者不支持异步完成时不合并, 直接执行
+        lock.unlock();
+        route->handler(response, request, path_match, arena);
+        return;
+    }
+
+    // 未命中的条目在插入时就计入容量, 满了并且淘汰不掉时不缓存
+    if (it == shard.entries.end()) {
+        if (shard.entries.size() >= max_entries_per_shard_ && !evict(shard, now)) {
+            lock.unlock();
+            route->handler(response, request, path_match, arena);
+            return;
+        }
+        it = shard.entries.emplace(key, Entry()).first;
+    }
+    auto writer = response.defer();
+    if (!writer) {
+        if (!it->second.response)
+            shard.entries.erase(it);
+        lock.unlock();
+        route->handler(response, request, path_match, arena);
+        return;
+    }
+    it->second.refreshing = true;
+    it->second.waiters.push_back({std::move(writer), &response});
+    lock.unlock();
+
+    // 第一个请求的连接在生成完成之前一直保持, 直接使用它的请求和内存池
+    std::make_shared<Fill>(shared_from_this(), route, std::move(key))->run(request, path_match, arena);
+}
+
+void ResponseCache::filled(const Route& route, const string& key, shared_ptr<const Cached> fresh) {
+    Shard& shard = shard_for(key);
+    std::vector<Waiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            waiters.swap(it->second.waiters);
+            store(shard, it, route, fresh);
+        }
+    }
+
+    // 出错的响应也返回给排队的请求, 只是不进入缓存
+    for (auto& waiter : waiters) {
+        if (fresh)
+            apply(*fresh, *waiter.response);
+        else
+            waiter.response->status(502) << "Bad Gateway";
+        waiter.writer->finish();
+    }
+}
+
+shared_ptr<const ResponseCache::Cached> ResponseCache::snapshot(const Response& response, const string* body) {
+    // 缓存的内容比连接的内存池活得久, 拷贝到全局分配器上
+    auto cached = std::make_shared<Cached>();
+    cached->status = response.status();
+    for (auto& h : response.headers())
+        cached->headers.emplace_back(h.first, h.second);
+    // 预先格式化的头部只是引用, 拆成一行一个头拷贝下来
+    std::string_view block = response.header_block();
+    while (!block.empty()) {
+        auto end = block.find("\r\n");
+        std::string_view line = block.substr(0, end);
+        block = end == std::string_view::npos ? std::string_view() : block.substr(end + 2);
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos)
+            continue;
+        std::string_view value = line.substr(colon + 1);
+        if (!value.empty() && value.front() == ' ')
+            value.remove_prefix(1);
+        cached->headers.emplace_back(line.substr(0, colon), value);
+    }
+    cached->body = std::make_shared<const string>(body ? *body : response.body_string());
+    return cached;
+}
+
+void ResponseCache::apply(const Cached& cached, Response& response) {
+    response.status(cached.status);
+    for (auto& h : cached.headers)
+        response.header(h.first, h.second);
+    response.body(cached.body);
+}
+
+// 调用时需要持有 shard.mutex
+void ResponseCache::store(Shard& shard, unordered_map<string, Entry>::iterator it, const Route& route, shared_ptr<const Cached> response) {
+    auto now = clock::now();
+    Entry& entry = it->second;
+    entry.refreshing = false;
+    // 只缓存 200 响应, 出错的响应照常返回但不进入缓存;
+    // 没有可用旧响应的条目直接删除, 不能让每个返回错误的 key 都留下一个条目
+    if (!response || response->status != 200) {
+        if (!entry.response || entry.stale_until <= now)
+            shard.entries.erase(it);
+        return;
+    }
+
+    entry.response = std::move(response);
+    entry.fresh_until = now + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(route.rule.ttl));
+    entry.stale_until = entry.fresh_until + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(route.rule.stale));
+}
+
+// 调用时需要持有 shard.mutex
+// 近似淘汰: 只看少量条目, 优先删除已经彻底过期的, 否则删除看到的第一个; 正在生成的条目不删除
+bool ResponseCache::evict(Shard& shard, clock::time_point now) {
+    auto victim = shard.entries.end();
+    size_t looked = 0;
+    for (auto it = shard.entries.begin(); it != shard.entries.end() && looked < 8; ++it) {
+        if (it->second.refreshing)
+            continue;
+        looked++;
+        if (victim == shard.entries.end())
+            victim = it;
+        if (it->second.stale_until < now) {
+            victim = it;
+            break;
+        }
+    }
+    if (victim == shard.entries.end())
+        return false;
+    shard.entries.erase(victim);
+    return true;
+}
+
+void ResponseCache::revalidate(const shared_ptr<Route>& route, const string& key, const Request& request) {
+    auto fill = std::make_shared<Fill>(shared_from_this(), route, key);
+    // 后台的请求只带方法、目标、路径和请求头: 请求体和表单属于客户端的连接, 后台生成时可能已经释放
+    auto background = std::make_shared<Request>();
+    background->method = request.method;
+    background->method_id = request.method_id;
+    background->target = request.target;
+    background->path = request.path;
+    background->query_begin = request.query_begin;
+    background->http_version = request.http_version;
+    background->header = request.header;
+    fill->request = std::move(background);
+
+    post(io_, [fill, route]() {
+        std::regex_match(fill->request->path, fill->path_match, route->pattern);
+        fill->run(*fill->request, fill->path_match, fill->arena);
+    });
+}
@@ -0,0 +1,89 @@
+#ifndef CACHE_HPP
+#define	CACHE_HPP
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "httpserver.hpp"
+
+
+// 动态响应的微缓存：同一个 key (方法 + 路径 + 指定的请求头) 在 ttl 内直接返回缓存的响应,
+// 并发的未命中只执行一次处理函数 (其余的请求排队, 不阻塞 I/O 线程), 过期后的 stale 时间内先返回旧响应, 同时在后台重新生成
+// 用法：
+//   auto cache = std::make_shared<ResponseCache>(io);
+//   server.resources_["^/$"]["GET"] = cache->wrap("^/$", server.resources_["^/$"]["GET"], {1.0, 10.0, {"Accept-Encoding"}});
+class ResponseCache : public std::enable_shared_from_this<ResponseCache> {
+public:
+    using Handler = function<void(Response&, const Request&, const smatch&, std::pmr::memory_resource&)>;
+
+    struct Rule {
+        double ttl = 1;                 // 秒, 缓存的有效时间
+        double stale = 0;               // 秒, 过期以后还可以返回旧响应的时间
+        std::vector<string> vary;       // 参与计算 key 的请求头
+    };
+
+    ResponseCache(io_context& io, size_t num_shards = 16, size_t max_entries = 4096);
+
+    // 包装一个处理函数, pattern 需要和注册到 resources_ 中的路径一致, 后台重新生成时用来匹配路径
+    Handler wrap(const string& pattern, Handler handler, Rule rule);
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    // 缓存的响应, 命中时响应体直接引用这里的数据, 不再拷贝
+    struct Cached {
+        int status;
+        std::vector<std::pair<string, string>> headers;
+        shared_ptr<const string> body;
+    };
+
+    // 等待正在生成的响应的请求, response 在 writer 完成之前一直有效
+    struct Waiter {
+        shared_ptr<ResponseWriter> writer;
+        Response* response;
+    };
+
+    struct Entry {
+        shared_ptr<const Cached> response;
+        clock::time_point fresh_until;
+        clock::time_point stale_until;
+        bool refreshing = false;             // 已经有一次生成在进行
+        std::vector<Waiter> waiters;
+    };
+
+    // 每个分片一把锁, 各分片放在不同的缓存行上, 避免多个 io_.run() 线程之间的伪共享
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        unordered_map<string, Entry> entries;
+    };
+
+    struct Route {
+        std::regex pattern;
+        Handler handler;
+        Rule rule;
+    };
+
+    // 一次生成的状态, 被包装的处理函数通过它异步完成响应
+    class Fill;
+
+    io_context& io_;
+    std::vector<Shard> shards_;
+    size_t max_entries_per_shard_;
+
+    void serve(const shared_ptr<Route>& route, Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena);
+    // 生成结束, fresh 为空表示失败; 更新缓存并完成排队的请求
+    void filled(const Route& route, const string& key, shared_ptr<const Cached> fresh);
+    void store(Shard& shard, unordered_map<string, Entry>::iterator it, const Route& route, shared_ptr<const Cached> response);
+    bool evict(Shard& shard, clock::time_point now);
+    static shared_ptr<const Cached> snapshot(const Response& response, const string* body);
+    static void apply(const Cached& cached, Response& response);
+    void revalidate(const shared_ptr<Route>& route, const string& key, const Request& request);
+
+    string make_key(const Rule& rule, const Request& request) const;
+    Shard& shard_for(const string& key);
+};
+
+#endif	/* CACHE_HPP */
@@ -0,0 +1,129 @@
+#include "capture.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+    const char magic[8] = {'H', 'T', 'T', 'P', 'C', 'A', 'P', '1'};
+
+    int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+CaptureWriter::CaptureWriter(const std::string& path, size_t max_body, size_t max_buffer)
+    : file_(path, std::ios::out | std::ios::binary | std::ios::trunc), max_body_(max_body), max_buffer_(max_buffer), start_(now()) {
+    if (!file_)
+        throw std::runtime_error("could not open capture file " + path);
+    file_.write(magic, sizeof(magic));
+    thread_ = std::thread([this]() {
+        run();
+    });
+}
+
+CaptureWriter::~CaptureWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    ready_.notify_one();
+    thread_.join();
+}
+
+void CaptureWriter::open(uint64_t connection) {
+    append(CaptureRecord::open, connection, nullptr, 0);
+}
+
+void CaptureWriter::request(uint64_t connection, const char* data, size_t size) {
+    append(CaptureRecord::request, connection, data, size);
+}
+
+void CaptureWriter::body(uint64_t connection, size_t offset, const char* data, size_t size) {
+    size_t kept = offset < max_body_ ? std::min(size, max_body_ - offset) : 0;
+    if (kept > 0)
+        append(CaptureRecord::body, connection, data, kept);
+    if (kept < size)
+        append(CaptureRecord::zeros, connection, nullptr, size - kept);
+}
+
+void CaptureWriter::close(uint64_t connection) {
+    append(CaptureRecord::close, connection, nullptr, 0);
+}
+
+void CaptureWriter::append(CaptureRecord::Type type, uint64_t connection, const char* data, size_t size) {
+    CaptureRecord record;
+    record.type = type;
+    record.connection = connection;
+    record.time = now() - start_;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    // size 只有 32 位, 更长的数据拆成多条同类型的记录 (request 之后的部分作为 body)
+    do {
+        size_t n = std::min<size_t>(size, std::numeric_limits<uint32_t>::max());
+        size_t bytes = sizeof(record) + (data ? n : 0);
+        if (buffer_.size() + bytes > max_buffer_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        record.size = static_cast<uint32_t>(n);
+        buffer_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        if (data) {
+            buffer_.append(data, n);
+            data += n;
+        }
+        size -= n;
+        if (record.type == CaptureRecord::request)
+            record.type = CaptureRecord::body;
+    } while (size > 0);
+
+    // 攒够一批再唤醒写线程, 其余的由写线程定时取走
+    if (buffer_.size() >= 256 * 1024) {
+        lock.unlock();
+        ready_.notify_one();
+    }
+}
+
+void CaptureWriter::run() {
+    std::string writing;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        ready_.wait_for(lock, std::chrono::milliseconds(200), [this]() {
+            return stop_ || buffer_.size() >= 256 * 1024;
+        });
+        bool stop = stop_;
+        // 交换以后在锁外写文件, 请求处理的线程可以继续追加
+        writing.swap(buffer_);
+        lock.unlock();
+
+        if (!writing.empty()) {
+            file_.write(writing.data(), writing.size());
+            file_.flush();
+            writing.clear();
+        }
+        if (stop)
+            return;
+        lock.lock();
+    }
+}
+
+CaptureReader::CaptureReader(const std::string& path) : file_(path, std::ios::in | std::ios::binary) {
+    char header[sizeof(magic)];
+    if (!file_.read(header, sizeof(header)) || std::memcmp(header, magic, sizeof(magic)) != 0)
+        throw std::runtime_error("not a capture file: " + path);
+}
+
+bool CaptureReader::next(CaptureRecord& record, std::string& data) {
+    if (!file_.read(reinterpret_cast<char*>(&record), sizeof(record)))
+        return false;
+    data.clear();
+    if (record.type == CaptureRecord::request || record.type == CaptureRecord::body) {
+        data.resize(record.size);
+        if (!file_.read(&data[0], record.size))
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#ifndef CAPTURE_HPP
+#define	CAPTURE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+// 请求录制文件的格式: 8 字节的 "HTTPCAP1", 然后是一条条记录, 整数都是本机字节序
+// 每条记录是 24 字节的 CaptureRecord, 后面跟 size 字节的数据 (zeros 没有数据, size 是字节数)
+struct CaptureRecord {
+    enum Type : uint8_t {
+        open = 1,       // 接受了一个连接
+        request = 2,    // 读到一个请求头, 数据是读到的全部字节 (请求头以及一起读到的请求体)
+        body = 3,       // 请求体的后续部分
+        zeros = 4,      // 超过 max_body 没有保存的请求体, 重放时发送同样多的 0
+        close = 5,      // 连接结束
+    };
+
+    uint8_t type = 0;
+    uint8_t reserved[3] = {};
+    uint32_t size = 0;
+    uint64_t connection = 0;    // 连接的编号, 同一时刻唯一, 连接关闭以后可能被新的连接重用
+    uint64_t time = 0;          // 录制开始以后的纳秒数
+};
+
+static_assert(sizeof(CaptureRecord) == 24, "CaptureRecord is written as is");
+
+// 把收到的请求原样录制下来, 供 tools/replay 按原来的连接和时间重放
+// 请求处理的线程只在锁内把记录追加到内存缓冲区, 由单独的线程写文件;
+// 文件写不过来、缓冲区超过 max_buffer 时丢弃新的记录并计数, 不阻塞请求
+class CaptureWriter {
+public:
+    // max_body: 每个请求最多保存的请求体字节数, 超过的部分只记长度 (上传的文件不会把录制文件撑大)
+    CaptureWriter(const std::string& path, size_t max_body = 1024 * 1024, size_t max_buffer = 64 * 1024 * 1024);
+    ~CaptureWriter();
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    void open(uint64_t connection);
+
+    void request(uint64_t connection, const char* data, size_t size);
+
+    // offset 是这一段之前已经收到的请求体字节数
+    void body(uint64_t connection, size_t offset, const char* data, size_t size);
+
+    void close(uint64_t connection);
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    std::ofstream file_;
+    size_t max_body_;
+    size_t max_buffer_;
+    int64_t start_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::string buffer_;            // 还没有写入文件的记录
+    bool stop_ = false;
+    std::atomic<uint64_t> dropped_{0};
+    std::thread thread_;
+
+    void append(CaptureRecord::Type type, uint64_t connection, const char* data, size_t size);
+
+    void run();
+};
+
+// 顺序读取录制文件, 最后一条记录不完整 (进程被结束时还没有写完) 时当作文件结束
+class CaptureReader {
+public:
+    explicit CaptureReader(const std::string& path);
+
+    // data 为记录的数据, zeros 记录的 data 为空
+    bool next(CaptureRecord& record, std::string& data);
+
+private:
+    std::ifstream file_;
+};
+
+#endif	/* CAPTURE_HPP */
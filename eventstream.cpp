@@ -0,0 +1,236 @@
+#include "eventstream.hpp"
+
+#include "response.hpp"
+
+namespace {
+    // 长连接的响应没有 Content-Length, 以关闭连接作为结束 (RFC 7230 3.3.3)
+    // X-Accel-Buffering 让前面的 nginx 不要缓冲
+    const std::string_view stream_headers =
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "X-Accel-Buffering: no\r\n";
+
+    // 和普通响应一样由 Response 拼出响应头, 带上 Date 和 Server (Date 用每个线程缓存的那一份)
+    EventStream::Event response_header() {
+        Response response;
+        response.header_block(stream_headers).content_length(-1);
+        auto head = response.to_buffers(false).front();
+        return std::make_shared<const std::string>(static_cast<const char*>(head.data()), head.size());
+    }
+
+    // 以冒号开头的行是注释, 客户端忽略 (HTML 5.2 9.2.6)
+    const EventStream::Event heartbeat_comment = std::make_shared<const std::string>(":\n");
+}
+
+EventStream::EventStream(std::shared_ptr<socket_type> socket, const Handler& handler, const Options& options)
+    : socket_(std::move(socket)), strand_(boost::asio::make_strand(socket_->get_executor())),
+    heartbeat_timer_(strand_), handler_(handler), options_(options) {
+    // 响应头总是第一个发出, on_open 中推送的事件排在它后面
+    pending_.push_back(response_header());
+    queued_bytes_ = pending_.back()->size();
+    busy_ = true;
+}
+
+EventStream::Event EventStream::encode(std::string_view data, std::string_view event, std::string_view id) {
+    auto s = std::make_shared<std::string>();
+    s->reserve(data.size() + event.size() + id.size() + 32);
+    if (!id.empty())
+        s->append("id: ").append(id).append("\n");
+    if (!event.empty())
+        s->append("event: ").append(event).append("\n");
+    for (;;) {
+        auto newline = data.find('\n');
+        s->append("data: ").append(data.substr(0, newline)).append("\n");
+        if (newline == std::string_view::npos)
+            break;
+        data.remove_prefix(newline + 1);
+    }
+    s->append("\n");
+    return s;
+}
+
+void EventStream::start() {
+    // 构造时 busy_ 已经置位, start() 之前推送的事件只入队, 在这里和响应头一起发出
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [self]() {
+        self->flush();
+        self->wait_closed();
+        self->heartbeat();
+    });
+}
+
+bool EventStream::push(Event event) {
+    if (closed_)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queued_bytes_ + event->size() > options_.max_queued) {
+        // 跟不上的客户端: 丢掉积压的事件并断开, 不让它拖住内存
+        closed_ = true;
+        auto self = shared_from_this();
+        boost::asio::post(strand_, [self]() {
+            self->finish();
+        });
+        return false;
+    }
+
+    queued_bytes_ += event->size();
+    pending_.push_back(std::move(event));
+    // 空闲时才需要安排一次 flush, 正在写时由写完成的回调接着发送
+    if (!busy_) {
+        busy_ = true;
+        auto self = shared_from_this();
+        boost::asio::post(strand_, [self]() {
+            self->flush();
+        });
+    }
+    return true;
+}
+
+void EventStream::close() {
+    closed_ = true;
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [self]() {
+        self->finish();
+    });
+}
+
+void EventStream::wait_closed() {
+    // 客户端不会再发送数据, 可读意味着对端关闭 (或者发来了不需要的数据, 丢掉)
+    auto self = shared_from_this();
+    socket_->async_wait(socket_type::wait_read, boost::asio::bind_executor(strand_, [self](const boost::system::error_code& ec) {
+        if (self->finished_)
+            return;
+        char discard[512];
+        boost::system::error_code rec;
+        if (!ec)
+            self->socket_->read_some(boost::asio::buffer(discard), rec);
+        if (ec || rec) {
+            self->finish();
+            return;
+        }
+        self->wait_closed();
+    }));
+}
+
+void EventStream::heartbeat() {
+    if (options_.heartbeat == 0)
+        return;
+    auto self = shared_from_this();
+    heartbeat_timer_.expires_after(std::chrono::seconds(options_.heartbeat));
+    heartbeat_timer_.async_wait(boost::asio::bind_executor(strand_, [self](const boost::system::error_code& ec) {
+        if (ec || self->finished_)
+            return;
+        // 和普通事件一样入队; 对端已经不在时写失败 (或者积压超过 max_queued) 会结束这个连接
+        if (self->push(heartbeat_comment))
+            self->heartbeat();
+    }));
+}
+
+bool EventStream::watch(std::weak_ptr<Topic> topic) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_)
+        return false;
+    topics_.push_back(std::move(topic));
+    return true;
+}
+
+void EventStream::flush() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        writing_.swap(pending_);
+        if (writing_.empty() || finished_) {
+            busy_ = false;
+            writing_.clear();
+            return;
+        }
+    }
+
+    buffers_.clear();
+    for (auto& event : writing_)
+        buffers_.emplace_back(boost::asio::buffer(*event));
+
+    auto self = shared_from_this();
+    boost::asio::async_write(*socket_, buffers_, boost::asio::bind_executor(strand_,
+        [self](const boost::system::error_code& ec, size_t bytes_transferred) {
+            {
+                std::lock_guard<std::mutex> lock(self->mutex_);
+                self->queued_bytes_ -= bytes_transferred;
+            }
+            self->writing_.clear();
+            if (ec) {
+                self->finish();
+                return;
+            }
+            self->flush();
+        }));
+}
+
+void EventStream::finish() {
+    if (finished_)
+        return;
+    finished_ = true;
+    closed_ = true;
+
+    heartbeat_timer_.cancel();
+    boost::system::error_code ignored;
+    socket_->shutdown(socket_type::shutdown_both, ignored);
+    socket_->close(ignored);
+    std::vector<std::weak_ptr<Topic>> topics;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.clear();
+        topics.swap(topics_);
+    }
+    // 在 mutex_ 之外退订: publish 持有 Topic 的锁时会调用 push
+    for (auto& weak : topics)
+        if (auto topic = weak.lock())
+            topic->unsubscribe(this);
+
+    if (handler_.on_close)
+        handler_.on_close(shared_from_this());
+}
+
+void Topic::subscribe(std::shared_ptr<EventStream> stream) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        subscribers_.push_back(stream);
+    }
+    // 不是由 shared_ptr 持有的 Topic 只能在 publish 时移除关闭的订阅者
+    auto self = weak_from_this();
+    if (!self.expired() && !stream->watch(std::move(self)))
+        unsubscribe(stream.get());
+}
+
+void Topic::unsubscribe(const EventStream* stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < subscribers_.size(); i++) {
+        if (subscribers_[i].get() == stream) {
+            subscribers_[i] = std::move(subscribers_.back());
+            subscribers_.pop_back();
+            return;
+        }
+    }
+}
+
+size_t Topic::publish(EventStream::Event event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t delivered = 0;
+    for (size_t i = 0; i < subscribers_.size(); ) {
+        if (subscribers_[i]->push(event)) {
+            delivered++;
+            i++;
+        }
+        else {
+            // 顺序无关, 用最后一个填补空位
+            subscribers_[i] = std::move(subscribers_.back());
+            subscribers_.pop_back();
+        }
+    }
+    return delivered;
+}
+
+size_t Topic::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return subscribers_.size();
+}
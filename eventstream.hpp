@@ -0,0 +1,115 @@
+#ifndef EVENTSTREAM_HPP
+#define	EVENTSTREAM_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+
+struct Request;
+class Topic;
+
+// Server-Sent Events (text/event-stream) 的一个订阅连接
+// 响应头发出以后连接保持打开, 之后推送的事件都是已经编码好的、不可变的 shared_ptr<const string>,
+// 同一条事件被所有订阅者的发送队列引用, 不拷贝; 每次写把队列中的事件组成 const_buffer 列表一次发出。
+// 队列中没有写出去的字节超过 max_queued 时认为客户端跟不上, 直接断开;
+// 每隔 heartbeat 秒发送一行注释 ":\n", 安静的连接上也能通过写失败发现已经不在的客户端
+class EventStream : public std::enable_shared_from_this<EventStream> {
+public:
+    typedef boost::asio::generic::stream_protocol::socket socket_type;
+    typedef std::shared_ptr<const std::string> Event;
+
+    // 按路径注册到 HTTPServer::event_streams_ 中, 在 on_open 里订阅 Topic
+    struct Handler {
+        std::function<void(std::shared_ptr<EventStream>, const Request&)> on_open;
+        std::function<void(std::shared_ptr<EventStream>)> on_close;
+    };
+
+    struct Options {
+        size_t max_queued = 1024 * 1024;    // 每个连接最多积压的字节数
+        size_t heartbeat = 15;              // 秒, 0 表示不发送
+    };
+
+    EventStream(std::shared_ptr<socket_type> socket, const Handler& handler, const Options& options);
+
+    // 发送响应头, 开始检测客户端断开
+    void start();
+
+    // 可以在任意线程调用; 连接已经关闭或者因为积压过多被断开时返回 false
+    bool push(Event event);
+
+    bool send(std::string_view data, std::string_view event = {}, std::string_view id = {}) {
+        return push(encode(data, event, id));
+    }
+
+    void close();
+
+    bool closed() const { return closed_; }
+
+    // 编码成 "id: ...\nevent: ...\ndata: ...\n\n", data 中的每一行单独一个 data 字段
+    static Event encode(std::string_view data, std::string_view event = {}, std::string_view id = {});
+
+private:
+    friend class Topic;
+
+    std::shared_ptr<socket_type> socket_;
+    boost::asio::strand<socket_type::executor_type> strand_;
+    boost::asio::steady_timer heartbeat_timer_;
+    const Handler& handler_;
+    const Options& options_;
+
+    std::mutex mutex_;
+    std::vector<Event> pending_;    // 等待发送的事件, push 和写完成时交换
+    size_t queued_bytes_ = 0;       // pending_ 和 writing_ 中的总字节数
+    bool busy_ = false;             // 已经安排了 flush 或者正在写
+    std::vector<std::weak_ptr<Topic>> topics_;  // 订阅的 Topic, 关闭时从中退订
+
+    // 只在 strand 上访问
+    std::vector<Event> writing_;
+    std::vector<boost::asio::const_buffer> buffers_;
+    bool finished_ = false;
+
+    std::atomic<bool> closed_{false};
+
+    void wait_closed();
+
+    void heartbeat();
+
+    // 记下订阅的 Topic; 已经关闭时返回 false, 由 Topic 自己退订
+    bool watch(std::weak_ptr<Topic> topic);
+
+    void flush();
+
+    void finish();
+};
+
+// 一组订阅者, 比如一个聊天室或者一类数据的更新
+// publish 只编码一次, 向 N 个订阅者广播的代价是 N 次入队 (引用计数加一) 和 N 次合并写
+// 由 shared_ptr 持有时订阅者关闭时立即退订, 否则在下一次 publish 时移除
+class Topic : public std::enable_shared_from_this<Topic> {
+public:
+    void subscribe(std::shared_ptr<EventStream> stream);
+
+    void unsubscribe(const EventStream* stream);
+
+    // 返回收到这条事件的订阅者数; 已经关闭的订阅者在这里移除
+    size_t publish(EventStream::Event event);
+
+    size_t publish(std::string_view data, std::string_view event = {}, std::string_view id = {}) {
+        return publish(EventStream::encode(data, event, id));
+    }
+
+    size_t size();
+
+private:
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<EventStream>> subscribers_;
+};
+
+#endif	/* EVENTSTREAM_HPP */
@@ -0,0 +1,412 @@
+#include "filecache.hpp"
+
+#include <cerrno>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+
+namespace {
+    const uint32_t watch_mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    // 按 '/' 切分并去掉空段和 "."; ".." 按字面回退一级, 退到根目录之外时返回 false
+    // 这样同一个文件只有一个 key, inotify 事件可以按 目录 + 文件名 找到对应的缓存项
+    bool normalize(std::string_view path, std::string& key) {
+        key.clear();
+        size_t i = 0;
+        while (i < path.size()) {
+            size_t j = path.find('/', i);
+            if (j == std::string_view::npos)
+                j = path.size();
+            size_t n = j - i;
+            if (n == 2 && path[i] == '.' && path[i + 1] == '.') {
+                if (key.empty())
+                    return false;
+                auto slash = key.rfind('/');
+                key.erase(slash == std::string::npos ? 0 : slash);
+            }
+            else if (n > 0 && !(n == 1 && path[i] == '.')) {
+                if (!key.empty())
+                    key += '/';
+                key.append(path, i, n);
+            }
+            i = j + 1;
+        }
+        return true;
+    }
+
+    void append_html(std::string& out, std::string_view s) {
+        for (char c : s) {
+            switch (c) {
+                case '&': out += "&amp;"; break;
+                case '<': out += "&lt;"; break;
+                case '>': out += "&gt;"; break;
+                case '"': out += "&quot;"; break;
+                default: out += c; break;
+            }
+        }
+    }
+
+    // 链接中的文件名, 除了不需要转义的字符都按字节百分号编码
+    void append_href(std::string& out, std::string_view s) {
+        static const char hex[] = "0123456789ABCDEF";
+        for (unsigned char c : s) {
+            if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '-' || c == '.' || c == '_' || c == '~') {
+                out += static_cast<char>(c);
+            }
+            else {
+                out += '%';
+                out += hex[c >> 4];
+                out += hex[c & 15];
+            }
+        }
+    }
+}
+
+std::atomic<bool> FileCache::no_openat2_(false);
+
+FileCache::File::~File() {
+    if (fd >= 0)
+        ::close(fd);
+}
+
+std::shared_ptr<const std::string> FileCache::File::contents() const {
+    auto data = std::make_shared<std::string>();
+    data->resize(st.st_size);
+    size_t done = 0;
+    while (done < data->size()) {
+        ssize_t n = ::pread(fd, &(*data)[done], data->size() - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::runtime_error("could not read file");
+        if (n == 0)
+            break;          // 文件在打开以后被截短了
+        done += n;
+    }
+    data->resize(done);
+    return data;
+}
+
+FileCache::FileCache(boost::asio::io_context& io, const std::string& root, size_t capacity)
+    : root_(boost::filesystem::canonical(root).string()), capacity_(capacity), inotify_(io) {
+
+    root_fd_ = ::open(root_.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd_ < 0)
+        throw std::runtime_error("could not open web root " + root_);
+
+    init_inotify();
+}
+
+void FileCache::init_inotify() {
+    // 没有 inotify 就无法知道文件什么时候变化, 只做安全的路径解析, 不缓存
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0) {
+        inotify_.assign(fd);
+        read_events();
+    }
+    else {
+        capacity_ = 0;
+    }
+}
+
+std::shared_ptr<const std::string> FileCache::listing(std::string_view path, int& error) {
+    std::string key;
+    if (!normalize(path, key)) {
+        error = EXDEV;
+        return nullptr;
+    }
+
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = directories_.find(key);
+        if (it != directories_.end()) {
+            if (!it->second.page)
+                render(key, it->second);
+            return it->second.page;
+        }
+        generation = generation_;
+    }
+
+    // 第一次请求这个目录时读取全部内容, 之后只按事件更新
+    Directory directory;
+    int fd = open_beneath(key.empty() ? "." : key);
+    if (fd < 0) {
+        error = errno;
+        return nullptr;
+    }
+    DIR* dir = ::fdopendir(fd);
+    if (dir == nullptr) {
+        error = errno;
+        ::close(fd);
+        return nullptr;
+    }
+    while (auto entry = ::readdir(dir)) {
+        struct stat st;
+        if (entry->d_name[0] == '.' || ::fstatat(fd, entry->d_name, &st, 0) != 0)
+            continue;
+        directory.entries[entry->d_name] = DirEntry{S_ISDIR(st.st_mode), st.st_size, st.st_mtime};
+    }
+    ::closedir(dir);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // 和 open() 一样, 读取期间收到过事件时这一次不缓存
+    if (capacity_ == 0 || generation != generation_ || directories_.count(key) > 0 ||
+        !watch_parents(key.empty() ? key : key + "/")) {
+        render(key, directory);
+        return directory.page;
+    }
+    if (directories_.size() >= capacity_)
+        directories_.erase(directories_.begin());
+    auto& cached = directories_[key];
+    cached = std::move(directory);
+    render(key, cached);
+    return cached.page;
+}
+
+void FileCache::render(const std::string& key, Directory& directory) {
+    for (auto& name : directory.changed) {
+        struct stat st;
+        std::string path = key.empty() ? name : key + "/" + name;
+        if (::fstatat(root_fd_, path.c_str(), &st, 0) == 0)
+            directory.entries[name] = DirEntry{S_ISDIR(st.st_mode), st.st_size, st.st_mtime};
+        else
+            directory.entries.erase(name);
+    }
+    directory.changed.clear();
+
+    std::string title = key.empty() ? "/" : "/" + key + "/";
+    auto page = std::make_shared<std::string>();
+    std::string& out = *page;
+    out.reserve(256 + directory.entries.size() * 128);
+    out += "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ";
+    append_html(out, title);
+    out += "</title></head>\n<body><h1>Index of ";
+    append_html(out, title);
+    out += "</h1><hr><pre>";
+    if (!key.empty())
+        out += "<a href=\"../\">../</a>\n";
+
+    // 子目录在前, 各自按名字排序
+    for (bool dirs : {true, false}) {
+        for (auto& entry : directory.entries) {
+            if (entry.second.dir != dirs)
+                continue;
+            auto& name = entry.first;
+            out += "<a href=\"";
+            append_href(out, name);
+            if (dirs)
+                out += '/';
+            out += "\">";
+            append_html(out, name);
+            if (dirs)
+                out += '/';
+            out += "</a>";
+            out.append(name.size() + dirs < 50 ? 50 - name.size() - dirs : 1, ' ');
+
+            char line[64];
+            struct tm tm;
+            gmtime_r(&entry.second.mtime, &tm);
+            size_t n = strftime(line, sizeof(line), "%d-%b-%Y %H:%M", &tm);
+            if (dirs)
+                snprintf(line + n, sizeof(line) - n, "%20s\n", "-");
+            else
+                snprintf(line + n, sizeof(line) - n, "%20lld\n", static_cast<long long>(entry.second.size));
+            out += line;
+        }
+    }
+    out += "</pre><hr></body></html>\n";
+    directory.page = page;
+}
+
+void FileCache::notify_fork() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // 关闭时取消父进程留下的读操作, 缓存项的监视在新实例上没有了, 一起清空
+    boost::system::error_code ignored;
+    inotify_.close(ignored);
+    entries_.clear();
+    lru_.clear();
+    directories_.clear();
+    watches_.clear();
+    watched_.clear();
+    generation_++;
+    init_inotify();
+}
+
+FileCache::~FileCache() {
+    boost::system::error_code ignored;
+    inotify_.close(ignored);
+    ::close(root_fd_);
+}
+
+std::shared_ptr<const FileCache::File> FileCache::open(std::string_view path, int& error) {
+    std::string key;
+    if (!normalize(path, key)) {
+        error = EXDEV;
+        return nullptr;
+    }
+
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.position);
+            return it->second.file;
+        }
+        generation = generation_;
+    }
+
+    auto file = std::make_shared<File>();
+    file->fd = open_beneath(key.empty() ? "." : key);
+    if (file->fd < 0 || ::fstat(file->fd, &file->st) != 0) {
+        error = errno;
+        return nullptr;
+    }
+
+    if (capacity_ == 0)
+        return file;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // 打开期间收到过 inotify 事件时, 刚打开的文件可能已经被替换, 这一次不放进缓存
+    if (generation != generation_ || entries_.count(key) > 0 || !watch_parents(key))
+        return file;
+
+    lru_.push_front(key);
+    entries_.emplace(key, Entry{file, lru_.begin()});
+    while (entries_.size() > capacity_) {
+        entries_.erase(lru_.back());
+        lru_.pop_back();
+    }
+    return file;
+}
+
+int FileCache::open_beneath(const std::string& path) {
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+    if (!no_openat2_) {
+        struct open_how how = {};
+        how.flags = O_RDONLY | O_CLOEXEC | O_NOCTTY;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd;
+        do {
+            fd = ::syscall(SYS_openat2, root_fd_, path.c_str(), &how, sizeof(how));
+        } while (fd < 0 && errno == EAGAIN);
+        if (fd >= 0 || errno != ENOSYS)
+            return fd;
+        no_openat2_ = true;
+    }
+#endif
+
+    // 内核不支持 openat2 (5.6 以前): 先解析出真实路径, 确认还在根目录下以后再打开
+    boost::system::error_code ec;
+    auto resolved = boost::filesystem::canonical(boost::filesystem::path(root_) / path, ec);
+    if (ec) {
+        errno = ec.value();
+        return -1;
+    }
+    const std::string& s = resolved.string();
+    if (s.compare(0, root_.size(), root_) != 0 || (s.size() > root_.size() && s[root_.size()] != '/')) {
+        errno = EXDEV;
+        return -1;
+    }
+    return ::open(s.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+}
+
+bool FileCache::watch_parents(const std::string& key) {
+    // key 所在的目录以及它的每一级上级目录, 目录被改名或删除时上一级目录会收到事件
+    std::string dir;
+    size_t i = 0;
+    for (;;) {
+        if (watched_.count(dir) == 0) {
+            std::string path = dir.empty() ? root_ : root_ + "/" + dir;
+            int wd = inotify_add_watch(inotify_.native_handle(), path.c_str(), watch_mask);
+            if (wd < 0)
+                return false;
+            watches_[wd] = dir;
+            watched_[dir] = wd;
+        }
+        size_t j = key.find('/', i);
+        if (j == std::string::npos)
+            return true;
+        dir = key.substr(0, j);
+        i = j + 1;
+    }
+}
+
+void FileCache::read_events() {
+    inotify_.async_read_some(boost::asio::buffer(events_), [this](const boost::system::error_code& ec, size_t bytes_transferred) {
+        if (ec)
+            return;
+        handle_events(bytes_transferred);
+        read_events();
+    });
+}
+
+void FileCache::handle_events(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_++;
+
+    for (size_t offset = 0; offset + sizeof(inotify_event) <= size; ) {
+        auto event = reinterpret_cast<const inotify_event*>(events_ + offset);
+        offset += sizeof(inotify_event) + event->len;
+
+        // 事件队列溢出、目录本身被删除或改名: 无法确定影响了哪些文件和目录, 全部失效
+        if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            clear();
+            directories_.clear();
+            if (event->mask & IN_IGNORED) {
+                auto it = watches_.find(event->wd);
+                if (it != watches_.end()) {
+                    watched_.erase(it->second);
+                    watches_.erase(it);
+                }
+            }
+            continue;
+        }
+
+        auto it = watches_.find(event->wd);
+        if (it == watches_.end() || event->len == 0)
+            continue;
+        std::string key = it->second.empty() ? std::string(event->name) : it->second + "/" + event->name;
+
+        // 所在目录的列表只需要重新 stat 这一个名字
+        auto directory = directories_.find(it->second);
+        if (directory != directories_.end()) {
+            directory->second.changed.insert(event->name);
+            directory->second.page.reset();
+        }
+
+        // 子目录发生变化: 无法确定影响了它下面的哪些文件, 文件全部失效, 它以及它下面的目录列表也失效
+        if (event->mask & IN_ISDIR) {
+            clear();
+            for (auto d = directories_.begin(); d != directories_.end(); ) {
+                if (d->first.compare(0, key.size(), key) == 0 && (d->first.size() == key.size() || d->first[key.size()] == '/'))
+                    d = directories_.erase(d);
+                else
+                    ++d;
+            }
+            continue;
+        }
+
+        auto entry = entries_.find(key);
+        if (entry != entries_.end()) {
+            lru_.erase(entry->second.position);
+            entries_.erase(entry);
+        }
+    }
+}
+
+void FileCache::clear() {
+    entries_.clear();
+    lru_.clear();
+}
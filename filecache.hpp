@@ -0,0 +1,108 @@
+#ifndef FILECACHE_HPP
+#define	FILECACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+#include <boost/asio.hpp>
+
+
+// 静态文件的打开缓存
+// web 根目录在启动时打开一次, 之后的路径都用 openat2(RESOLVE_BENEATH) 相对它解析, 由内核保证不会逃出根目录,
+// 不再对每一级路径做 lstat / readlink; 打开的 fd 和 fstat 的结果放在固定大小的 LRU 中,
+// 根目录下的文件发生变化时由 inotify 通知失效, 命中时不需要任何系统调用
+class FileCache {
+public:
+    struct File {
+        int fd = -1;
+        struct stat st;
+
+        File() = default;
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+        ~File();
+
+        // 读取整个文件 (pread, 不改变 fd 的偏移, 多个线程可以同时读)
+        std::shared_ptr<const std::string> contents() const;
+    };
+
+    FileCache(boost::asio::io_context& io, const std::string& root, size_t capacity = 256);
+    ~FileCache();
+
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    // path 是请求的路径, 相对于根目录; 失败时返回空指针, error 为 errno (EXDEV 表示路径在根目录之外)
+    // 返回的 File 在被淘汰或失效以后仍然可以使用, 最后一个引用释放时才关闭 fd
+    std::shared_ptr<const File> open(std::string_view path, int& error);
+
+    // 目录列表页面 (autoindex), path 是目录相对于根目录的路径; 失败时返回空指针, error 为 errno
+    // 第一次请求时 readdir 一次, 之后按 inotify 事件只重新 stat 变化的名字, 页面缓存到目录下一次变化
+    std::shared_ptr<const std::string> listing(std::string_view path, int& error);
+
+    // fork 以后在子进程中调用: 继承来的 inotify 实例和父进程共用, 事件只会被其中一个进程读到, 换成新的实例
+    void notify_fork();
+
+private:
+    struct Entry {
+        std::shared_ptr<const File> file;
+        std::list<std::string>::iterator position;
+    };
+
+    struct DirEntry {
+        bool dir = false;
+        off_t size = 0;
+        time_t mtime = 0;
+    };
+
+    struct Directory {
+        std::map<std::string, DirEntry> entries;        // 按名字排序, 不包括以 '.' 开头的名字
+        std::set<std::string> changed;                  // 收到事件以后还没有重新 stat 的名字
+        std::shared_ptr<const std::string> page;        // 为空时下次请求重新生成
+    };
+
+    std::string root_;
+    int root_fd_ = -1;
+    size_t capacity_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_;                    // 最近使用的在前面
+    uint64_t generation_ = 0;                       // 每收到一批 inotify 事件加一
+    std::unordered_map<std::string, Directory> directories_;  // 目录 (相对根目录) -> 列表
+
+    // inotify 只能监视单个目录, 缓存的文件所在的每一级目录都要监视
+    boost::asio::posix::stream_descriptor inotify_;
+    std::unordered_map<int, std::string> watches_;  // watch descriptor -> 目录 (相对根目录)
+    std::unordered_map<std::string, int> watched_;
+    alignas(8) char events_[4096];
+
+    static std::atomic<bool> no_openat2_;
+
+    int open_beneath(const std::string& path);
+
+    void init_inotify();
+
+    bool watch_parents(const std::string& key);
+
+    void read_events();
+
+    void handle_events(size_t size);
+
+    void clear();
+
+    // 按 changed 更新 entries 并生成页面, 调用时持有 mutex_
+    void render(const std::string& key, Directory& directory);
+};
+
+#endif	/* FILECACHE_HPP */
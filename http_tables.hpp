@@ -0,0 +1,215 @@
+#ifndef HTTP_TABLES_HPP
+#define	HTTP_TABLES_HPP
+
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+
+// 编译期生成的完美哈希表: HTTP 方法、常用请求头、文件扩展名 -> Content-Type
+// 查找时只需要计算一次哈希、探测一个槽位、比较一次字符串, 并且不区分大小写
+namespace http {
+
+    constexpr char to_lower(char c) {
+        return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    }
+
+    constexpr bool iequals(std::string_view a, std::string_view b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++)
+            if (to_lower(a[i]) != to_lower(b[i]))
+                return false;
+        return true;
+    }
+
+    // 不区分大小写的 FNV-1a, seed 由编译期搜索得到
+    constexpr uint32_t ihash(std::string_view s, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;
+        for (char c : s) {
+            h ^= static_cast<uint8_t>(to_lower(c));
+            h *= 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    // N 个 key 放进 Size 个槽位 (Size 为 2 的幂), 每个槽位存 key 的下标, 0xff 表示空
+    template <size_t N, size_t Size>
+    struct PerfectHash {
+        static_assert(N < 0xff, "too many keys");
+        static_assert((Size & (Size - 1)) == 0, "table size must be a power of two");
+
+        std::array<std::string_view, N> keys;
+        std::array<uint8_t, Size> slots{};
+        uint32_t seed = 0;
+
+        constexpr explicit PerfectHash(const std::array<std::string_view, N>& k) : keys(k) {
+            for (uint32_t s = 1; s < 100000; s++) {
+                if (try_seed(s)) {
+                    seed = s;
+                    return;
+                }
+            }
+        }
+
+        constexpr bool try_seed(uint32_t s) {
+            for (auto& slot : slots)
+                slot = 0xff;
+            for (size_t i = 0; i < N; i++) {
+                auto& slot = slots[ihash(keys[i], s) & (Size - 1)];
+                if (slot != 0xff)
+                    return false;
+                slot = static_cast<uint8_t>(i);
+            }
+            return true;
+        }
+
+        // 返回 key 的下标, 找不到时返回 N
+        constexpr size_t find(std::string_view s) const {
+            uint8_t i = slots[ihash(s, seed) & (Size - 1)];
+            return (i != 0xff && iequals(keys[i], s)) ? i : N;
+        }
+    };
+
+    // ---------------- 方法 ----------------
+
+    enum class Method : uint8_t {
+        get, head, post, put, delete_, connect, options, trace, patch,
+        unknown
+    };
+
+    constexpr size_t num_methods = static_cast<size_t>(Method::unknown);
+
+    constexpr PerfectHash<num_methods, 32> method_table(std::array<std::string_view, num_methods>{{
+        "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH"
+    }});
+    static_assert(method_table.seed != 0, "no perfect hash seed for methods");
+
+    // 方法名区分大小写 (RFC 7230), 因此除了哈希探测之外还要求完全相同
+    constexpr Method method(std::string_view s) {
+        size_t i = method_table.find(s);
+        return (i < num_methods && method_table.keys[i] == s) ? static_cast<Method>(i) : Method::unknown;
+    }
+
+    constexpr std::string_view method_name(Method m) {
+        return m == Method::unknown ? std::string_view() : method_table.keys[static_cast<size_t>(m)];
+    }
+
+    // ---------------- 常用请求头 / 响应头 ----------------
+
+    enum class Field : uint8_t {
+        accept, accept_encoding, accept_language, authorization, cache_control, connection,
+        content_encoding, content_length, content_type, cookie, date, etag, expect, forwarded,
+        host, if_match, if_modified_since, if_none_match, if_range, keep_alive, last_modified,
+        location, origin, proxy_connection, range, referer, server, te, trailer, transfer_encoding,
+        upgrade, user_agent, x_forwarded_for, x_real_ip,
+        unknown
+    };
+
+    constexpr size_t num_fields = static_cast<size_t>(Field::unknown);
+
+    constexpr PerfectHash<num_fields, 256> field_table(std::array<std::string_view, num_fields>{{
+        "Accept", "Accept-Encoding", "Accept-Language", "Authorization", "Cache-Control", "Connection",
+        "Content-Encoding", "Content-Length", "Content-Type", "Cookie", "Date", "ETag", "Expect", "Forwarded",
+        "Host", "If-Match", "If-Modified-Since", "If-None-Match", "If-Range", "Keep-Alive", "Last-Modified",
+        "Location", "Origin", "Proxy-Connection", "Range", "Referer", "Server", "TE", "Trailer", "Transfer-Encoding",
+        "Upgrade", "User-Agent", "X-Forwarded-For", "X-Real-IP"
+    }});
+    static_assert(field_table.seed != 0, "no perfect hash seed for header fields");
+
+    constexpr Field field(std::string_view s) {
+        return static_cast<Field>(field_table.find(s));
+    }
+
+    constexpr std::string_view field_name(Field f) {
+        return f == Field::unknown ? std::string_view() : field_table.keys[static_cast<size_t>(f)];
+    }
+
+    // 逐跳 (hop-by-hop) 头部, 代理时不转发
+    constexpr bool is_hop_by_hop(Field f) {
+        return f == Field::connection || f == Field::keep_alive || f == Field::proxy_connection ||
+               f == Field::te || f == Field::trailer || f == Field::transfer_encoding || f == Field::upgrade;
+    }
+
+    // ---------------- 文件扩展名 -> Content-Type ----------------
+
+    constexpr size_t num_mime_types = 34;
+
+    constexpr PerfectHash<num_mime_types, 256> mime_table(std::array<std::string_view, num_mime_types>{{
+        "html", "htm", "css", "js", "mjs", "json", "xml", "txt", "md", "csv",
+        "png", "jpg", "jpeg", "gif", "webp", "svg", "ico", "bmp", "avif",
+        "woff", "woff2", "ttf", "otf", "wasm", "pdf", "zip", "gz", "tar",
+        "mp3", "mp4", "webm", "ogg", "wav", "map"
+    }});
+    static_assert(mime_table.seed != 0, "no perfect hash seed for mime types");
+
+    constexpr std::array<std::string_view, num_mime_types> mime_values = {{
+        "text/html; charset=utf-8", "text/html; charset=utf-8", "text/css; charset=utf-8",
+        "text/javascript; charset=utf-8", "text/javascript; charset=utf-8", "application/json",
+        "application/xml", "text/plain; charset=utf-8", "text/markdown; charset=utf-8", "text/csv; charset=utf-8",
+        "image/png", "image/jpeg", "image/jpeg", "image/gif", "image/webp", "image/svg+xml", "image/x-icon",
+        "image/bmp", "image/avif",
+        "font/woff", "font/woff2", "font/ttf", "font/otf", "application/wasm", "application/pdf",
+        "application/zip", "application/gzip", "application/x-tar",
+        "audio/mpeg", "video/mp4", "video/webm", "audio/ogg", "audio/wav", "application/json"
+    }};
+
+    // 按文件名 (或路径) 的扩展名查找 Content-Type, 未知的扩展名返回 application/octet-stream
+    constexpr std::string_view mime_type(std::string_view filename) {
+        auto dot = filename.rfind('.');
+        auto slash = filename.find_last_of("/\\");
+        if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash))
+            return "application/octet-stream";
+        size_t i = mime_table.find(filename.substr(dot + 1));
+        return i < num_mime_types ? mime_values[i] : "application/octet-stream";
+    }
+
+    // ---------------- 不区分大小写的请求头表 ----------------
+
+    struct CaseInsensitiveHash {
+        size_t operator()(std::string_view s) const { return ihash(s, 0); }
+    };
+
+    struct CaseInsensitiveEqual {
+        bool operator()(std::string_view a, std::string_view b) const { return iequals(a, b); }
+    };
+
+    // 使用 pmr 分配器, 解析请求时从连接的内存池中分配
+    typedef std::pmr::unordered_map<std::pmr::string, std::pmr::string, CaseInsensitiveHash, CaseInsensitiveEqual> HeaderMap;
+
+    // 以 Method 为下标的表, 用于 resources_ 中每个路径下的处理函数
+    // 保留 ["GET"] 这样的写法, 扩展方法 (比如 WebDAV 的 PROPFIND) 放在后备的 unordered_map 中
+    template <class T>
+    class MethodMap {
+    public:
+        T& operator[](const std::string& name) {
+            Method m = method(name);
+            if (m == Method::unknown)
+                return others_[name];
+            present_[static_cast<size_t>(m)] = true;
+            return values_[static_cast<size_t>(m)];
+        }
+
+        T* find(Method m, std::string_view name) {
+            if (m == Method::unknown) {
+                auto it = others_.find(std::string(name));
+                return it == others_.end() ? nullptr : &it->second;
+            }
+            return present_[static_cast<size_t>(m)] ? &values_[static_cast<size_t>(m)] : nullptr;
+        }
+
+        T* find(std::string_view name) { return find(method(name), name); }
+
+        size_t count(std::string_view name) { return find(name) ? 1 : 0; }
+
+    private:
+        std::array<T, num_methods> values_{};
+        std::array<bool, num_methods> present_{};
+        std::unordered_map<std::string, T> others_;
+    };
+}
+
+#endif	/* HTTP_TABLES_HPP */
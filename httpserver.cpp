@@ -1,70 +1,236 @@
 #include "httpserver.hpp"
+#include "capture.hpp"
+#include "filecache.hpp"
+#include "master.hpp"
+#include "ratelimit.hpp"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    Listener tcp_listener(unsigned short port) {
+        Listener listener;
+        listener.port = port;
+        return listener;
+    }
+
+    bool is_inet(int family) {
+        return family == AF_INET || family == AF_INET6;
+    }
+
+    // 取出对端的 IP 地址, unix domain socket 没有 IP 地址时返回 false
+    bool remote_ip(const HTTPServer::socket_type& socket, ip::address& address) {
+        boost::system::error_code ec;
+        auto endpoint = socket.remote_endpoint(ec);
+        if (ec || !is_inet(endpoint.protocol().family()))
+            return false;
+        ip::tcp::endpoint tcp_endpoint;
+        memcpy(tcp_endpoint.data(), endpoint.data(), endpoint.size());
+        address = tcp_endpoint.address();
+        // 双栈监听时 IPv4 客户端的地址形如 ::ffff:1.2.3.4, 还原成 IPv4 地址
+        if (address.is_v6() && address.to_v6().is_v4_mapped())
+            address = ip::make_address_v4(ip::v4_mapped, address.to_v6());
+        return true;
+    }
+
+#ifdef _DEBUG
+    string remote_string(const HTTPServer::socket_type& socket) {
+        ip::address address;
+        if (!remote_ip(socket, address))
+            return "unix socket";
+        return "ip : " + address.to_string();
+    }
+#endif // _DEBUG
+
+    // 录制时连接的编号, 用 socket 对象的地址: 同一时刻唯一, 对象释放前先记录 close
+    uint64_t connection_id(const HTTPServer::socket_type* socket) {
+        return reinterpret_cast<uintptr_t>(socket);
+    }
+
+    // read_buffer 末尾刚读到的 size 字节
+    const char* last_read(const streambuf& read_buffer, size_t size) {
+        return static_cast<const char*>(read_buffer.data().data()) + read_buffer.size() - size;
+    }
+
+    // 在连接的内存池中构造对象; 删除器持有内存池, 保证对象析构时内存池还在
+    template <class T>
+    shared_ptr<T> make_in_arena(const shared_ptr<Arena>& arena) {
+        void* p = arena->allocate(sizeof(T), alignof(T));
+        T* t = new (p) T(arena.get());
+        return shared_ptr<T>(t, [arena](T* t) { t->~T(); });
+    }
+
+    template <int Level, int Name>
+    void set_int_option(HTTPServer::acceptor_type& acceptor, int value) {
+        detail::socket_option::integer<Level, Name> option(value);
+        acceptor.set_option(option);
+    }
+
+    void set_cork(HTTPServer::socket_type& socket, bool on) {
+        detail::socket_option::integer<IPPROTO_TCP, TCP_CORK> option(on ? 1 : 0);
+        boost::system::error_code ignored;
+        socket.set_option(option, ignored);
+    }
+}
 
 HTTPServer::HTTPServer(boost::asio::io_context& io, unsigned short port , size_t num_threads, size_t request_timeout, size_t content_timeout)
-    : io_(io), endpoint_(ip::tcp::v4(), port),
-    acceptor_(io_, endpoint_), num_threads_(num_threads),
+    : HTTPServer(io, std::vector<Listener>{tcp_listener(port)}, num_threads, request_timeout, content_timeout)
+    {
+    }
+
+HTTPServer::HTTPServer(boost::asio::io_context& io, const std::vector<Listener>& listeners, size_t num_threads, size_t request_timeout, size_t content_timeout)
+    : io_(io), num_threads_(num_threads),
     request_timeout_(request_timeout), content_timeout_(content_timeout)
     {
-    // ķʽ
+    for (auto& listener : listeners)
+        listen(listener);
+
+    // 定义请求的方式
 
-    //ֱӷHost, 127.0.0.1:8080 ,ûо·,.
-    this->resources_["^/$"]["GET"] = [](ostream& response, const Request& request, const smatch& path_match) {
-        std::stringstream content_stream;
-        content_stream << "<h1>Request:</h1>";
-        content_stream << request.method << " " << request.path << " HTTP/" << request.http_version << "<br>";
+    //直接访问Host,比如 127.0.0.1:8080 ,没有具体的路径,返回请求的详情.
+    // 状态行、Content-Length 等由 Response 在发送时生成, 这里只需要写响应体
+    this->resources_["^/$"]["GET"] = [](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+        response.header("Content-Type", "text/html; charset=utf-8");
+        response << "<h1>Request:</h1>";
+        response << request.method << " " << request.target << " HTTP/" << request.http_version << "<br>";
         for (auto& header : request.header) {
-            content_stream << header.first << ": " << header.second << "<br>";
+            response << header.first << ": " << header.second << "<br>";
         }
-
-        //stringstreamָƵĩβ, Ժtellpȡĳ.
-        content_stream.seekp(0, std::ios::end);
-
-        response << "HTTP/1.1 200 OK\r\nContent-Length: " << content_stream.tellp() << "\r\n\r\n" << content_stream.rdbuf();
     };
 
-    // ʾļ,  http://127.0.0.1:8080/test.html
-    this->resources_["^/.+$"]["GET"] = [](ostream& response, const Request& request, const smatch& path_match) {
+    // 访问具体文件, 比如 http://127.0.0.1:8080/test.html
+    // 放在 default_resource_ 中, resources_ 里的路径(比如反向代理的 ^/api/.*)优先匹配
+    file_cache_ = std::make_shared<FileCache>(io_, "web");
+    this->default_resource_["GET"] = [this, files = file_cache_](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
         
         try {
-            boost::filesystem::path web_root_path = boost::filesystem::canonical("web");
-            boost::filesystem::path path = boost::filesystem::canonical(web_root_path / request.path);
-            // ȷĿ¼ web_root_path 
-            if (std::distance(web_root_path.begin(), web_root_path.end()) > std::distance(path.begin(), path.end()) ||
-                !std::equal(web_root_path.begin(), web_root_path.end(), path.begin()))
-                throw std::invalid_argument("path must be within root path");
-
-            // path Ϊ/ ȫΪ/index.html
-            // if (boost::filesystem::is_directory(path))
-            //     path /= "index.html";
-            auto ifs = std::make_shared<ifstream>();
-            ifs->open(path.string(), ifstream::in | ios::binary | ios::ate);
-            ifs->seekg(0, std::ios::beg);
-            if (*ifs) {
-                std::stringstream content_stream;
-                content_stream << ifs->rdbuf();
-                content_stream.seekp(0, ios::end);
-                response << "HTTP/1.1 200 OK\r\nContent-Length: " << content_stream.tellp() << "\r\n\r\n" << content_stream.rdbuf();
+            // 路径由内核相对 web 根目录解析 (openat2 RESOLVE_BENEATH), 不会逃出根目录
+            int error = 0;
+            auto file = files->open(request.path, error);
+            if (!file) {
+                if (error == EXDEV || error == ELOOP)
+                    throw std::invalid_argument("path must be within root path");
+                throw std::invalid_argument("could not read file");
             }
 
-            else
+            std::string_view type = http::mime_type(request.path);
+            if (S_ISDIR(file->st.st_mode)) {
+                // 目录的地址不以 '/' 结尾时重定向, 页面中的相对链接才会指向目录下的文件
+                if (request.path.back() != '/') {
+                    std::pmr::string location(request.target, &arena);
+                    location.insert(std::min(location.find('?'), location.size()), 1, '/');
+                    response.status(301).header("Location", location);
+                    return;
+                }
+
+                // 目录下有 index.html 时返回它, 否则返回目录列表
+                std::pmr::string index(request.path, &arena);
+                index += "index.html";
+                auto index_file = files->open(index, error);
+                if (index_file && S_ISREG(index_file->st.st_mode)) {
+                    file = index_file;
+                    type = http::mime_type(index);
+                }
+                else if (autoindex_) {
+                    auto page = files->listing(request.path, error);
+                    if (!page)
+                        throw std::invalid_argument("could not read directory");
+                    response.header("Content-Type", "text/html; charset=utf-8");
+                    response.body(page);
+                    return;
+                }
+            }
+            if (!S_ISREG(file->st.st_mode))
                 throw std::invalid_argument("could not read file");
-            ifs->close();
+
+            response.header("Content-Type", type);
+            if (file->st.st_size > 0)
+                response.body(file->contents());
         }
         catch (const std::exception& e) {
-            std::stringstream content_stream;
             std::cerr << ": " << request.path << std::endl;
-            content_stream << "Could not open path " << e.what() << std::endl;
-            content_stream.seekp(0, ios::end);
-
-            response << "HTTP/1.1 404 NOT FOUND\r\nContent-Length: " << content_stream.tellp() << "\r\n\r\n" << content_stream.rdbuf();
+            response.status(404).header("Content-Type", "text/plain");
+            response << "Could not open path " << e.what() << std::endl;
         }
     };
+
+    // WebSocket 示例: 把收到的消息原样发回
+    this->websocket_["^/echo$"].on_message = [](std::shared_ptr<WebSocket> ws, std::string_view message, bool binary) {
+        ws->send(message, binary);
+    };
 }
 
-void HTTPServer::start() {
-    accept();
+void HTTPServer::listen(const Listener& listener) {
+    auto acceptor = std::make_shared<acceptor_type>(io_);
+
+    if (listener.type == "unix") {
+        // 上次运行留下的 socket 文件会导致 bind 失败
+        struct stat st;
+        if (::stat(listener.path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            ::unlink(listener.path.c_str());
+
+        generic::stream_protocol::endpoint endpoint(local::stream_protocol::endpoint(listener.path));
+        acceptor->open(endpoint.protocol());
+        acceptor->bind(endpoint);
+    }
+    else {
+        ip::tcp::endpoint tcp_endpoint(ip::make_address(listener.address), listener.port);
+        generic::stream_protocol::endpoint endpoint(tcp_endpoint);
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(socket_base::reuse_address(true));
+        if (tcp_endpoint.address().is_v6())
+            acceptor->set_option(ip::v6_only(listener.v6only));
+#ifdef TCP_DEFER_ACCEPT
+        // 连接上有数据到达以后才唤醒 accept, 不发请求的空连接不占用 io 线程
+        if (listener.defer_accept > 0)
+            set_int_option<IPPROTO_TCP, TCP_DEFER_ACCEPT>(*acceptor, listener.defer_accept);
+#endif
+        acceptor->bind(endpoint);
+    }
+
+    // 新连接会继承监听 socket 的缓冲区大小
+    if (listener.rcvbuf > 0)
+        acceptor->set_option(socket_base::receive_buffer_size(listener.rcvbuf));
+    if (listener.sndbuf > 0)
+        acceptor->set_option(socket_base::send_buffer_size(listener.sndbuf));
 
-    //  num_threads  run ߳
+    acceptor->listen(listener.backlog);
+
+#ifdef TCP_FASTOPEN
+    if (listener.type != "unix" && listener.fastopen > 0)
+        set_int_option<IPPROTO_TCP, TCP_FASTOPEN>(*acceptor, listener.fastopen);
+#endif
+
+    acceptors_.emplace_back(acceptor, listener.type != "unix");
+}
+
+void HTTPServer::start() {
+    // resources_ 中的路径在启动时编译一次, 不再每个请求都编译
+    routes_.clear();
+    for (auto& res : resources_)
+        routes_.emplace_back(std::regex(res.first), &res.second);
+    websocket_routes_.clear();
+    for (auto& ws : websocket_)
+        websocket_routes_.emplace_back(std::regex(ws.first), &ws.second);
+    event_stream_routes_.clear();
+    for (auto& es : event_streams_)
+        event_stream_routes_.emplace_back(std::regex(es.first), &es.second);
+    multipart_routes_.clear();
+    for (auto& mp : multipart_)
+        multipart_routes_.emplace_back(std::regex(mp.first), &mp.second);
+    max_body_routes_.clear();
+    for (auto& mb : max_body_)
+        max_body_routes_.emplace_back(std::regex(mb.first), mb.second);
+
+    for (auto& acceptor : acceptors_)
+        accept(acceptor.first, acceptor.second);
+
+    // 根据 num_threads 创建多个 run 线程
     for(size_t c = 1;c < num_threads_; c++) {
         threads_.emplace_back([this](){
             io_.run();
@@ -73,91 +239,201 @@ void HTTPServer::start() {
 
     io_.run();
 
-    // ߳
+    // 启动其他线程
     for(std::thread& t: threads_) {
         t.join(); // -> io_.run();
     }
 }
 
-void HTTPServer::accept() {
+void HTTPServer::notify_fork(boost::asio::io_context::fork_event event) {
+    io_.notify_fork(event);
+    if (event == boost::asio::io_context::fork_child && file_cache_)
+        file_cache_->notify_fork();
+}
+
+void HTTPServer::accept(shared_ptr<acceptor_type> acceptor, bool tcp) {
     
-    // ָsocket 
-    shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(io_));
+    // 用智能指针管理socket 对象
+    shared_ptr<socket_type> socket;
+    if (capture_) {
+        // 连接上的最后一个引用释放时连接结束
+        socket.reset(new socket_type(io_), [capture = capture_](socket_type* socket) {
+            capture->close(connection_id(socket));
+            delete socket;
+        });
+    }
+    else {
+        socket.reset(new socket_type(io_));
+    }
 
-    acceptor_.async_accept(*socket, [this, socket](const boost::system::error_code& ec) {
+    acceptor->async_accept(*socket, [this, acceptor, tcp, socket](const boost::system::error_code& ec) {
         
-        //ȴ½һsocket ½
-        accept();
+        //区别于先处理，再新建一个socket， 这里是先新建，后处理
+        accept(acceptor, tcp);
 
         if(!ec) {
-            ip::tcp::no_delay option(true);
-            socket->set_option(option);
+            if (tcp) {
+                ip::tcp::no_delay option(true);
+                socket->set_option(option);
+            }
 
 #ifdef _DEBUG
-            std::cout << "socket accepted, ip : " << socket->remote_endpoint().address().to_string() << ", port : " << socket->remote_endpoint().port() << std::endl;
+            std::cout << "socket accepted, " << remote_string(*socket) << std::endl;
 #endif // _DEBUG
 
-            process_request_and_respond(socket);
+            if (stats_)
+                stats_->connections.fetch_add(1, std::memory_order_relaxed);
+            if (capture_)
+                capture_->open(connection_id(socket.get()));
+
+            process_request_and_respond(socket, std::make_shared<Arena>());
         }
     });
 }
 
-void HTTPServer::process_request_and_respond(shared_ptr<ip::tcp::socket> socket) {
-    // httpԺ ʼ
-    //  shared_ptr  read_buffer 
+void HTTPServer::process_request_and_respond(shared_ptr<socket_type> socket, shared_ptr<Arena> arena) {
+    // 上一个请求和响应已经析构, 内存池可以整体回收
+    arena->release();
+
+    // 建立http连接以后 开始发送数据
+    // 用 shared_ptr 来管理 read_buffer 对象
 
     shared_ptr<streambuf> read_buffer(new streambuf);
     
-    // Ѿܵһ󣬵ȴͺݣʱ䳬request_timeout_socketر
+    // 已经接受到一个请求，等待请求发送后续数据，如果时间超过request_timeout_，则将socket关闭
     shared_ptr<deadline_timer> timer;
     if (request_timeout_ > 0) {
         timer = set_socket_timeout(socket, request_timeout_);
     }
 
-    async_read_until(*socket, *read_buffer, "\r\n\r\n",               // bytes_transferred ǵָָֽ
-    [this, socket, read_buffer, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
+    int64_t read_start = RequestTrace::now();
+
+    async_read_until(*socket, *read_buffer, "\r\n\r\n",               // bytes_transferred 是到指定定界符并包括指定定界符的字节数。
+    [this, socket, read_buffer, timer, read_start, arena](const boost::system::error_code& ec, size_t bytes_transferred) {
+        int64_t header_read = RequestTrace::now();
 
         if (request_timeout_ > 0) {
             timer->cancel();
         }
         if(!ec) {
-            //read_buffer->size() ܺ bytes_transferred ͬ
-            //ִasync_read_until֮streambuf ܰdelimiter֮ݡ
-            //ѡĽڽͷʱֱӴstreamан 
-            //read_bufferʣ ںasync_readдڼݣ
+            //read_buffer->size() 可能和 bytes_transferred 不同
+            //执行async_read_until之后，streambuf 可能包含delimiter之外的其他数据”
+            //选择的解决方案是在解析标头时直接从stream中按行解析。 
+            //read_buffer剩余的内容 在函数async_read中处理（用于检索内容）
+
+            // 限流: 按 IP 的检查放在解析请求之前, 按路径的检查放在读取请求体之前
+            // unix domain socket 上的连接来自本机, 不限流
+            ip::address remote_address;
+            bool limited = rate_limiter_ && remote_ip(*socket, remote_address);
+            if (limited && !rate_limiter_->allow(remote_address)) {
+                reject(socket);
+                return;
+            }
 
             size_t total = read_buffer->size();
+            if (capture_)
+                capture_->request(connection_id(socket.get()), last_read(*read_buffer, total), total);
 
             istream stream(read_buffer.get());
 
-            shared_ptr<Request> request(new Request());
-            *request=parse_request(stream);
+            shared_ptr<Request> request = make_in_arena<Request>(arena);
+            parse_request(stream, *request, *arena);
+            request->trace.mark(RequestTrace::read_start, read_start);
+            request->trace.mark(RequestTrace::header_read, header_read);
+            request->trace.mark(RequestTrace::parsed);
+            if (request->path.empty()) {
+                reject(socket, 400);
+                return;
+            }
+
+            if (limited && rate_limiter_->has_routes() && !rate_limiter_->allow(remote_address, request->path)) {
+                reject(socket);
+                return;
+            }
+
+            // 握手成功以后连接不再按 HTTP 处理
+            if (!websocket_routes_.empty() && request->method_id == http::Method::get &&
+                upgrade(socket, request, read_buffer, arena))
+                return;
+            if (!event_stream_routes_.empty() && request->method_id == http::Method::get &&
+                subscribe(socket, request))
+                return;
+
+            if (!max_body_routes_.empty() && request->content_length > 0) {
+                for (auto& route : max_body_routes_) {
+                    if (regex_match(request->path.begin(), request->path.end(), route.first)) {
+                        if (request->content_length > static_cast<long long>(route.second)) {
+                            reject(socket, 413);
+                            return;
+                        }
+                        break;
+                    }
+                }
+            }
+
+            // 注册为上传的路径: 请求体不读进内存, 边读边解析
+            if (!multipart_routes_.empty() && request->content_length > 0) {
+                const MultipartForm::Options* options = nullptr;
+                for (auto& route : multipart_routes_) {
+                    if (regex_match(request->path.begin(), request->path.end(), route.first)) {
+                        options = route.second;
+                        break;
+                    }
+                }
+                auto content_type = request->header.find(http::HeaderMap::key_type("Content-Type", arena.get()));
+                std::string_view boundary;
+                if (options && content_type != request->header.end())
+                    boundary = MultipartParser::boundary(content_type->second);
+                if (!boundary.empty()) {
+                    if (options->max_size > 0 && request->content_length > static_cast<long long>(options->max_size)) {
+                        reject(socket, 413);
+                        return;
+                    }
+                    request->form = std::make_shared<MultipartForm>(boundary, *options);
+
+                    shared_ptr<deadline_timer> timer;
+                    if (content_timeout_ > 0) {
+                        timer = set_socket_timeout(socket, content_timeout_);
+                    }
+                    size_t remaining = request->content_length;
+                    read_form(socket, std::move(request), read_buffer, arena, remaining, timer);
+                    return;
+                }
+            }
 
             size_t num_additional_bytes = total - bytes_transferred;
 
-            // ͷ֮, Content 
-            if(request->header.count("Content-Length") > 0) {
-                // transfer_exactly ʾָҪ read ֽ
+            // 请求除了头之外, 还有Content (已经读到 read_buffer 里的部分不用再读)
+            if(request->content_length > static_cast<long long>(num_additional_bytes)) {
+                // transfer_exactly 显示的指定要 read 的字节数
                 shared_ptr<deadline_timer> timer;
                 if (content_timeout_ > 0) {
                     timer = set_socket_timeout(socket, content_timeout_);
                 }
 
-                async_read(*socket, *read_buffer, transfer_exactly(stoull(request->header["Content-Length"]) - num_additional_bytes), 
-                [this, socket, read_buffer, request, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
+                size_t remaining = request->content_length - num_additional_bytes;
+                async_read(*socket, *read_buffer, transfer_exactly(remaining), 
+                [this, socket, read_buffer, request = std::move(request), timer, arena, num_additional_bytes](const boost::system::error_code& ec, size_t bytes_transferred) mutable {
                     if (content_timeout_ > 0)
                         timer->cancel();
+                    if (capture_ && bytes_transferred > 0)
+                        capture_->body(connection_id(socket.get()), num_additional_bytes, last_read(*read_buffer, bytes_transferred), bytes_transferred);
                     if(!ec) {
-                        // Store pointer to read_buffer as istream object
-                        // shared_ptr<istream> content;
-                        request->content = shared_ptr<istream>(new istream(read_buffer.get()));
+                        // istream 持有 read_buffer, 异步完成的处理函数在返回以后还可以读取请求体
+                        request->content = shared_ptr<istream>(new istream(read_buffer.get()), [read_buffer](istream* s) { delete s; });
+                        request->trace.mark(RequestTrace::body_read);
 
-                        respond(socket, request);
+                        respond(socket, std::move(request), arena);
                     }
                 });
             }
-            else {                        
-                respond(socket, request);
+            else {
+                // 请求体已经随请求头一起读到了 read_buffer 中
+                if (request->content_length >= 0) {
+                    request->content = shared_ptr<istream>(new istream(read_buffer.get()), [read_buffer](istream* s) { delete s; });
+                    request->trace.mark(RequestTrace::body_read);
+                }
+                respond(socket, std::move(request), arena);
             }
         }
     });
@@ -165,17 +441,177 @@ void HTTPServer::process_request_and_respond(shared_ptr<ip::tcp::socket> socket)
 
 
 
-shared_ptr<deadline_timer> HTTPServer::set_socket_timeout(shared_ptr<ip::tcp::socket> socket, size_t time) {
+void HTTPServer::reject(shared_ptr<socket_type> socket, int status) {
+    // 预先生成好的响应, 发送后关闭连接, 未读取的请求体直接丢弃
+    static const string too_many_requests =
+        "HTTP/1.1 429 Too Many Requests\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 17\r\n"
+        "\r\n"
+        "Too Many Requests";
+    static const string bad_request =
+        "HTTP/1.1 400 Bad Request\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 11\r\n"
+        "\r\n"
+        "Bad Request";
+    static const string payload_too_large =
+        "HTTP/1.1 413 Payload Too Large\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 17\r\n"
+        "\r\n"
+        "Payload Too Large";
+    static const string internal_server_error =
+        "HTTP/1.1 500 Internal Server Error\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 21\r\n"
+        "\r\n"
+        "Internal Server Error";
+    const string& response = status == 400 ? bad_request : status == 413 ? payload_too_large :
+                             status == 500 ? internal_server_error : too_many_requests;
+
+    shared_ptr<deadline_timer> timer;
+    if (content_timeout_ > 0) {
+        timer = set_socket_timeout(socket, content_timeout_);
+    }
+
+    async_write(*socket, buffer(response), [this, socket, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
+        if (content_timeout_ > 0) {
+            timer->cancel();
+        }
+        boost::system::error_code ignored;
+        socket->shutdown(socket_base::shutdown_both, ignored);
+        socket->close(ignored);
+    });
+}
+
+bool HTTPServer::upgrade(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<streambuf> read_buffer, shared_ptr<Arena> arena) {
+    auto end = request->header.end();
+    auto upgrade_header = request->header.find(http::HeaderMap::key_type("Upgrade", arena.get()));
+    if (upgrade_header == end || !http::iequals(upgrade_header->second, "websocket"))
+        return false;
+
+    const WebSocket::Handler* handler = nullptr;
+    for (auto& route : websocket_routes_) {
+        if (regex_match(request->path.begin(), request->path.end(), route.first)) {
+            handler = route.second;
+            break;
+        }
+    }
+    if (handler == nullptr)
+        return false;
+
+    shared_ptr<Response> response = make_in_arena<Response>(arena);
+    auto key = request->header.find(http::HeaderMap::key_type("Sec-WebSocket-Key", arena.get()));
+    auto version = request->header.find(http::HeaderMap::key_type("Sec-WebSocket-Version", arena.get()));
+    bool deflate = false;
+    if (key == end || key->second.empty() || version == end || version->second != "13") {
+        // 只支持 RFC 6455 (版本 13), 告诉客户端支持的版本以后关闭连接
+        response->status(426).header("Sec-WebSocket-Version", "13").header("Connection", "close");
+        handler = nullptr;
+    }
+    else {
+        response->status(101).header("Upgrade", "websocket").header("Connection", "Upgrade")
+            .header("Sec-WebSocket-Accept", WebSocket::accept_key(key->second));
+        auto extensions = request->header.find(http::HeaderMap::key_type("Sec-WebSocket-Extensions", arena.get()));
+        deflate = websocket_options_.deflate && extensions != end && WebSocket::accept_deflate(extensions->second);
+        if (deflate)
+            response->header("Sec-WebSocket-Extensions", WebSocket::deflate_response());
+    }
+
+    shared_ptr<deadline_timer> timer;
+    if (content_timeout_ > 0) {
+        timer = set_socket_timeout(socket, content_timeout_);
+    }
+
+    async_write(*socket, response->to_buffers(false), [this, socket, request, response, read_buffer, timer, arena, handler, deflate](const boost::system::error_code& ec, size_t bytes_transferred) mutable {
+        if (content_timeout_ > 0) {
+            timer->cancel();
+        }
+        if (ec || handler == nullptr) {
+            boost::system::error_code ignored;
+            socket->shutdown(socket_base::shutdown_both, ignored);
+            socket->close(ignored);
+            return;
+        }
+
+        // 读请求头时多读到的字节是客户端紧接着发来的帧
+        string initial(buffers_begin(read_buffer->data()), buffers_end(read_buffer->data()));
+        auto ws = std::make_shared<WebSocket>(socket, *handler, websocket_options_, deflate);
+        if (handler->on_open)
+            handler->on_open(ws, *request);
+
+        response.reset();
+        request.reset();
+        ws->start(std::move(initial));
+    });
+    return true;
+}
+
+bool HTTPServer::subscribe(shared_ptr<socket_type> socket, shared_ptr<Request> request) {
+    for (auto& route : event_stream_routes_) {
+        if (regex_match(request->path.begin(), request->path.end(), route.first)) {
+            // 响应头和之后的事件都由 EventStream 发送, 连接不再读取新的请求
+            auto stream = std::make_shared<EventStream>(socket, *route.second, event_stream_options_);
+            if (route.second->on_open)
+                route.second->on_open(stream, *request);
+            stream->start();
+            return true;
+        }
+    }
+    return false;
+}
+
+void HTTPServer::read_form(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<streambuf> read_buffer,
+                           shared_ptr<Arena> arena, size_t remaining, shared_ptr<deadline_timer> timer) {
+    // read_buffer 中已有的数据 (请求头之后多读到的, 或者上一次读到的) 直接交给解析器, 文件内容从这里写入磁盘
+    auto data = read_buffer->data();
+    size_t size = std::min(data.size(), remaining);
+    bool ok = request->form->feed(static_cast<const char*>(data.data()), size);
+    read_buffer->consume(size);
+    remaining -= size;
+
+    if (ok && remaining == 0)
+        ok = request->form->finish();
+    if (!ok || remaining == 0) {
+        if (content_timeout_ > 0)
+            timer->cancel();
+        if (!ok) {
+            reject(socket, request->form->status());
+            return;
+        }
+        request->trace.mark(RequestTrace::body_read);
+        respond(socket, std::move(request), arena);
+        return;
+    }
+
+    // 缓冲区每次只准备 64KB, 用完后 consume, 整个上传过程中占用的内存不随请求体增长
+    auto buffers = read_buffer->prepare(std::min<size_t>(remaining, 64 * 1024));
+    socket->async_read_some(buffers, [this, socket, request = std::move(request), read_buffer, arena, remaining, timer](const boost::system::error_code& ec, size_t bytes_transferred) mutable {
+        if (ec) {
+            if (content_timeout_ > 0)
+                timer->cancel();
+            return;
+        }
+        read_buffer->commit(bytes_transferred);
+        if (capture_)
+            capture_->body(connection_id(socket.get()), request->content_length - remaining, last_read(*read_buffer, bytes_transferred), bytes_transferred);
+        read_form(socket, std::move(request), read_buffer, arena, remaining, timer);
+    });
+}
+
+shared_ptr<deadline_timer> HTTPServer::set_socket_timeout(shared_ptr<socket_type> socket, size_t time) {
     std::shared_ptr<deadline_timer> timer(new deadline_timer(io_));
     timer->expires_from_now(boost::posix_time::seconds(time));
     timer->async_wait([socket](const boost::system::error_code& ec) {
         if (!ec) {
 
 #ifdef _DEBUG
-            std::cout << "socket time_out, ip : "<< socket->remote_endpoint().address().to_string() << ", port : " << socket->remote_endpoint().port() <<std::endl;
+            std::cout << "socket time_out, " << remote_string(*socket) << std::endl;
 #endif // _DEBUG
 
-            socket->shutdown(ip::tcp::socket::shutdown_both);
+            socket->shutdown(socket_base::shutdown_both);
             socket->close();
         }
     });
@@ -183,73 +619,340 @@ shared_ptr<deadline_timer> HTTPServer::set_socket_timeout(shared_ptr<ip::tcp::so
 }
 
 
-Request HTTPServer::parse_request(istream& stream) {
-    Request request;
-    //HTTPһΪ
-    //GET /index.html HTTP/1.1   ƥʱոΪֽ㣬sm[1] sm[2] sm[2]
-    std::regex e("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");
-
-    smatch sm;
-    string line;
+void HTTPServer::parse_request(istream& stream, Request& request, Arena& arena) {
+    //HTTP第一行为：
+    //GET /index.html HTTP/1.1   以空格为分界点, 依次是方法、路径和版本
+    // 直接在行内切分, 不用正则: std::regex 每次匹配都要从全局分配器申请内部的状态表
+    std::pmr::string line(&arena);
     getline(stream, line);
-    line.pop_back();
-    if(regex_match(line, sm, e)) {        
-        request.method=sm[1];
-        request.path=sm[2];
-        request.http_version=sm[3];
-
-        bool matched;
-
-        e = "^([^:]*): ?(.*)$";
-        //Ժÿֵӵrequest.headerֵ
-        do {
-            getline(stream, line);
+    if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+
+    std::string_view v(line);
+    auto sp1 = v.find(' ');
+    auto sp2 = sp1 == std::string_view::npos ? sp1 : v.find(' ', sp1 + 1);
+    if (sp2 == std::string_view::npos || v.find(' ', sp2 + 1) != std::string_view::npos ||
+        v.compare(sp2 + 1, 5, "HTTP/") != 0)
+        return;
+
+    request.method.assign(v.substr(0, sp1));
+    request.method_id=http::method(request.method);
+    request.target.assign(v.substr(sp1 + 1, sp2 - sp1 - 1));
+    // 非法的转义留下空的 path, 由调用者返回 400
+    if (!http::parse_target(request.target, request.path, request.query_begin))
+        request.path.clear();
+    request.http_version.assign(v.substr(sp2 + 6));
+
+    //对后面的每个键值对做分析，加到request.header字典中, 遇到空行 (没有冒号的行) 结束
+    while (getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r')
             line.pop_back();
-            matched=regex_match(line, sm, e);
-            if(matched) {
-                request.header[sm[1]]=sm[2];
+        auto colon = line.find(':');
+        if (colon == std::pmr::string::npos)
+            break;
+
+        std::pmr::string name(line, 0, colon, &arena);
+        http::Field field = http::field(name);
+        auto& value = request.header[std::move(name)];
+        size_t value_begin = colon + 1;
+        if (value_begin < line.size() && line[value_begin] == ' ')
+            value_begin++;
+        value.assign(line, value_begin);
+
+        // 常用的头在解析时就取出来, 后面不用再查表
+        if (field == http::Field::content_length) {
+            char* end;
+            long long n = strtoll(value.c_str(), &end, 10);
+            request.content_length = (end != value.c_str() && n >= 0) ? n : -1;
+        }
+    }
+}
+
+// 处理函数可能在返回之前 (另一个线程上的异步操作已经完成) 就调用 finish() 等, 这时 respond() 还持有请求和响应,
+// 发送完成后回收内存池就会出错; 所以处理函数返回之前提交的操作先保存下来, 由 release() 执行
+class HTTPServer::Exchange : public ResponseWriter, public std::enable_shared_from_this<HTTPServer::Exchange> {
+public:
+    Exchange(HTTPServer* server, shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<Response> response, shared_ptr<Arena> arena)
+        : server_(server), socket_(std::move(socket)), request_(std::move(request)), response_(std::move(response)), arena_(std::move(arena)) {}
+
+    void finish() override {
+        auto self = shared_from_this();
+        run([self]() {
+            if (self->done_.exchange(true))
+                return;
+            self->server_->send(self->socket_, std::move(self->request_), std::move(self->response_), std::move(self->arena_));
+        });
+    }
+
+    void write_head(Handler handler) override {
+        auto self = shared_from_this();
+        run([self, handler = std::move(handler)]() mutable {
+            if (self->done_)
+                return self->abort(std::move(handler));
+            self->started_ = true;
+            if (self->server_->content_timeout_ > 0)
+                self->timer_ = self->server_->set_socket_timeout(self->socket_, self->server_->content_timeout_);
+
+            auto& request = *self->request_;
+            auto& response = *self->response_;
+            int status = response.status();
+            self->keep_alive_ = strtof(request.http_version.c_str(), nullptr) > 1.05;
+            self->no_body_ = request.method_id == http::Method::head || status < 200 || status == 204 || status == 304;
+            // 长度未知: HTTP/1.1 的客户端用 chunked 编码, HTTP/1.0 的客户端以关闭连接表示结束
+            if (!self->no_body_ && response.content_length() < 0) {
+                if (self->keep_alive_) {
+                    response.header("Transfer-Encoding", "chunked");
+                    self->chunked_ = true;
+                }
             }
+            self->write(response.to_buffers(false), std::move(handler));
+        });
+    }
 
-        } while(matched==true);
+    void write_body(const_buffer data, Handler handler) override {
+        auto self = shared_from_this();
+        run([self, data, handler = std::move(handler)]() mutable {
+            if (self->done_)
+                return self->abort(std::move(handler));
+            if (self->no_body_ || data.size() == 0) {
+                post(self->socket_->get_executor(), [handler = std::move(handler)]() {
+                    handler(boost::system::error_code());
+                });
+                return;
+            }
+            if (!self->chunked_) {
+                self->write(data, std::move(handler));
+                return;
+            }
+            int n = snprintf(self->chunk_head_, sizeof(self->chunk_head_), "%zx\r\n", data.size());
+            std::array<const_buffer, 3> buffers{{buffer(self->chunk_head_, n), data, buffer("\r\n", 2)}};
+            self->write(buffers, std::move(handler));
+        });
     }
 
-    return request;
-}
+    void end(bool ok) override {
+        auto self = shared_from_this();
+        run([self, ok]() {
+            if (self->done_)
+                return;
+            if (!self->started_) {
+                // 没有流式发送过, 按 finish() 发送 Response 中的内容; 中断时直接关闭连接
+                if (ok) {
+                    self->done_ = true;
+                    self->server_->send(self->socket_, std::move(self->request_), std::move(self->response_), std::move(self->arena_));
+                }
+                else {
+                    self->complete(false);
+                }
+                return;
+            }
+            if (!ok || !self->chunked_)
+                return self->complete(ok && self->keep_alive_);
+            async_write(*self->socket_, buffer("0\r\n\r\n", 5), [self](const boost::system::error_code& ec, size_t bytes_transferred) {
+                self->bytes_ += bytes_transferred;
+                self->complete(!ec);
+            });
+        });
+    }
 
-void HTTPServer::respond(shared_ptr<ip::tcp::socket> socket, shared_ptr<Request> request) {
+    any_io_executor get_executor() override {
+        return socket_->get_executor();
+    }
 
-    // std::cout << " request->path : "<<request->path << endl;
-    for(auto& res: resources_) {
-        std::regex e(res.first);
-        auto& methods = res.second;
-        smatch sm_res;
-        if(regex_match(request->path, sm_res, e)) {
-            if(methods.count(request->method)>0) {
-                shared_ptr<boost::asio::streambuf> write_buffer(new boost::asio::streambuf);
-                ostream response(write_buffer.get());
-
-                // ԺresponseѾҪصϢ
-                methods[request->method](response, *request, sm_res);
+    // 处理函数已经返回, respond() 不再持有请求和响应
+    void release() {
+        std::vector<function<void()>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            released_ = true;
+            pending.swap(pending_);
+        }
+        for (auto& action : pending)
+            action();
+    }
 
-                shared_ptr<deadline_timer> timer;
-                if (content_timeout_ > 0) {
-                    timer = set_socket_timeout(socket, content_timeout_);
-                }
+private:
+    HTTPServer* server_;
+    shared_ptr<socket_type> socket_;
+    shared_ptr<Request> request_;
+    shared_ptr<Response> response_;
+    shared_ptr<Arena> arena_;
+    shared_ptr<deadline_timer> timer_;
+
+    std::mutex mutex_;
+    bool released_ = false;
+    std::vector<function<void()>> pending_;
+
+    // 同一时刻只有一个操作, 这些状态不用加锁; done_ 在处理函数抛出异常时可能和异步操作同时访问
+    std::atomic<bool> done_{false};
+    bool started_ = false;
+    bool chunked_ = false;
+    bool keep_alive_ = false;
+    bool no_body_ = false;
+    size_t bytes_ = 0;
+    char chunk_head_[24];
+
+    void run(function<void()> action) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!released_) {
+                pending_.push_back(std::move(action));
+                return;
+            }
+        }
+        action();
+    }
 
-                //lambdaвwrite_bufferȷasync_write֮ǰ
-                async_write(*socket, *write_buffer, [this, socket, request, write_buffer, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
-                    //ʱHTTP1.1ϵİ汾ʹó־ӣsocket
-                    if (content_timeout_ > 0) {
-                        timer->cancel();
-                    }
+    template <class Buffers>
+    void write(const Buffers& buffers, Handler handler) {
+        auto self = shared_from_this();
+        async_write(*socket_, buffers, [self, handler = std::move(handler)](const boost::system::error_code& ec, size_t bytes_transferred) {
+            self->bytes_ += bytes_transferred;
+            if (ec)
+                self->complete(false);
+            handler(ec);
+        });
+    }
 
-                    if(!ec && stof(request->http_version) > 1.05)
-                        // ʹ async_read_until ȴ 
-                        process_request_and_respond(socket);
-                });
+    void abort(Handler handler) {
+        post(socket_->get_executor(), [handler = std::move(handler)]() {
+            handler(error::operation_aborted);
+        });
+    }
+
+    // 结束这个请求, keep_alive 为 false 时关闭连接 (响应不完整时客户端由此知道)
+    void complete(bool keep_alive) {
+        done_ = true;
+        if (timer_)
+            timer_->cancel();
+
+        if (server_->stats_) {
+            server_->stats_->requests.fetch_add(1, std::memory_order_relaxed);
+            server_->stats_->bytes_sent.fetch_add(bytes_, std::memory_order_relaxed);
+        }
+        if (server_->tracer_) {
+            request_->trace.mark(RequestTrace::written);
+            server_->tracer_->record(request_->trace, request_->method, request_->path);
+        }
+
+        // 和 send() 一样, 先析构请求和响应, 下一个请求才能回收内存池
+        response_.reset();
+        request_.reset();
+        if (keep_alive) {
+            server_->process_request_and_respond(socket_, std::move(arena_));
+            return;
+        }
+        boost::system::error_code ec;
+        socket_->shutdown(socket_base::shutdown_both, ec);
+        socket_->close(ec);
+    }
+};
+
+void HTTPServer::respond(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<Arena> arena) {
+
+    // std::cout << " request->path : "<<request->path << endl;
+    function<void(Response&, const Request&, const smatch&, std::pmr::memory_resource&)>* handler = nullptr;
+    smatch sm_res(arena.get());
+    for(auto& route: routes_) {
+        if(regex_match(request->path, sm_res, route.first)) {
+            handler = route.second->find(request->method_id, request->method);
+            if(handler != nullptr)
                 break;
-            }
         }
     }
-    return;
-}
\ No newline at end of file
+    // resources_ 中都没有匹配, 交给 default_resource_
+    if(handler == nullptr) {
+        handler = default_resource_.find(request->method_id, request->method);
+        if(handler == nullptr)
+            return;
+    }
+
+    request->trace.mark(RequestTrace::routed);
+
+    shared_ptr<Response> response = make_in_arena<Response>(arena);
+    // 处理函数调用 defer() 时才创建, 之后由它发送响应
+    shared_ptr<Exchange> exchange;
+    response->on_defer([&]() -> shared_ptr<ResponseWriter> {
+        exchange = std::make_shared<Exchange>(this, socket, request, response, arena);
+        return exchange;
+    });
+
+    // 调用以后，response中已经填充好了要返回的信息
+    // 处理函数抛出的异常不能漏到 io_context::run() 之外, 还没有 defer 时返回 500, 否则按响应中断处理
+    try {
+        (*handler)(*response, *request, sm_res, *arena);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "handler " << request->method << " " << request->path << ": " << e.what() << std::endl;
+        if (exchange) {
+            exchange->end(false);
+        }
+        else {
+            response->reset();
+            response->status(500);
+        }
+    }
+    request->trace.mark(RequestTrace::handled);
+
+    if (exchange) {
+        // 请求和响应由 exchange 持有, 这里先放开引用, 再让它执行处理函数返回之前提交的操作
+        request.reset();
+        response.reset();
+        exchange->release();
+        return;
+    }
+    response->on_defer(nullptr);
+    send(socket, std::move(request), std::move(response), std::move(arena));
+}
+
+void HTTPServer::send(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<Response> response, shared_ptr<Arena> arena) {
+    shared_ptr<deadline_timer> timer;
+    if (content_timeout_ > 0) {
+        timer = set_socket_timeout(socket, content_timeout_);
+    }
+
+    // 状态行、头部和响应体组成一个 const_buffer 列表, 一次 async_write 发送
+    //在lambda中捕获response，确保在async_write完成之前不会销毁它
+    // request 和 response 移动到回调中, 不在这里留引用: 回调可能在别的线程上先执行, 回收内存池时它们必须已经析构
+    auto& buffers = response->to_buffers(request->method_id != http::Method::head);
+    size_t size = buffer_size(buffers);
+    bool zerocopy = send_options_.zerocopy_min > 0 && size >= send_options_.zerocopy_min && ZeroCopyWriter::usable(*socket);
+    // 需要多次 write 的响应在发送期间 cork, 结束时取消, 只有最后一个报文可能不满; unix domain socket 上设置失败, 忽略
+    bool cork = !zerocopy && send_options_.cork_min > 0 && size >= send_options_.cork_min;
+    if (cork)
+        set_cork(*socket, true);
+
+    auto on_written = [this, socket, request = std::move(request), response = std::move(response), timer, arena, cork](const boost::system::error_code& ec, size_t bytes_transferred) mutable {
+        //如果时HTTP1.1或者以上的版本，使用持久连接，不立即销毁socket
+        if (content_timeout_ > 0) {
+            timer->cancel();
+        }
+        if (cork)
+            set_cork(*socket, false);
+
+        if (stats_) {
+            stats_->requests.fetch_add(1, std::memory_order_relaxed);
+            stats_->bytes_sent.fetch_add(bytes_transferred, std::memory_order_relaxed);
+        }
+
+        if (tracer_) {
+            request->trace.mark(RequestTrace::written);
+            tracer_->record(request->trace, request->method, request->path);
+        }
+
+        bool keep_alive = strtof(request->http_version.c_str(), nullptr) > 1.05;
+
+        // 请求和响应都在连接的内存池中, 先析构它们, 下一个请求才能回收内存池
+        response.reset();
+        request.reset();
+
+        if(!ec && keep_alive)
+            // 使用 async_read_until 继续等待其他数据请求
+            process_request_and_respond(socket, arena);
+    };
+
+    if (zerocopy)
+        ZeroCopyWriter::write(socket, buffers, std::move(on_written));
+    else
+        async_write(*socket, buffers, std::move(on_written));
+}
@@ -2,6 +2,7 @@
 #define	HTTPSERVER_HPP
 
 #include <iostream>
+#include <memory_resource>
 #include <regex>
 #include <unordered_map>
 #include <thread>
@@ -9,6 +10,15 @@
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 
+#include "eventstream.hpp"
+#include "http_tables.hpp"
+#include "multipart.hpp"
+#include "response.hpp"
+#include "trace.hpp"
+#include "uri.hpp"
+#include "websocket.hpp"
+#include "zerocopy.hpp"
+
 
 using std::string;
 using std::shared_ptr;
@@ -16,46 +26,177 @@ using std::unordered_map;
 using std::function;
 using std::istream;
 using std::ostream;
-using std::smatch;
 using std::ifstream;
 using std::ios;
 
 using namespace boost::asio;
 
+// 路径匹配的结果, 匹配的是 pmr::string, 结果也从连接的内存池中分配
+typedef std::match_results<std::pmr::string::const_iterator,
+                           std::pmr::polymorphic_allocator<std::sub_match<std::pmr::string::const_iterator>>> smatch;
+
+class RateLimiter;
+class FileCache;
+class CaptureWriter;
+struct WorkerStats;
+
+// 一个监听地址, 可以是 IPv4 / IPv6 (双栈) 的 TCP 端口, 也可以是 unix domain socket
+struct Listener {
+    string type = "tcp";            // "tcp" 或者 "unix"
+    string address = "0.0.0.0";     // "::" 并且 v6only 为 false 时同时接受 IPv4 和 IPv6
+    unsigned short port = 8080;
+    string path;                    // unix domain socket 的路径
+    int backlog = socket_base::max_listen_connections;
+    bool v6only = false;
+    int fastopen = 0;               // TCP_FASTOPEN 队列长度, 0 表示不开启
+    int defer_accept = 0;           // TCP_DEFER_ACCEPT, 等待客户端数据的秒数, 0 表示不开启
+    int rcvbuf = 0;                 // SO_RCVBUF, 0 表示使用系统默认值
+    int sndbuf = 0;                 // SO_SNDBUF
+};
+
+// 响应的发送方式, 按整个响应 (头部加响应体) 的大小选择
+struct SendOptions {
+    size_t cork_min = 64 * 1024;    // 不小于这个大小时发送期间打开 TCP_CORK, 多次 write 之间不发出不满的报文; 0 表示不用
+    size_t zerocopy_min = 0;        // 不小于这个大小并且对端不是本机时用 MSG_ZEROCOPY 发送; 0 表示不用
+};
+
+// 每个连接一块内存池, 解析请求、路由和处理函数的临时分配都从这里取, 一个响应发送完以后整体回收
+// 大部分请求用不完内置的 4KB, 不会访问全局的分配器
+class Arena : public std::pmr::monotonic_buffer_resource {
+public:
+    Arena() : std::pmr::monotonic_buffer_resource(buffer_, sizeof(buffer_)) {}
+
+private:
+    alignas(std::max_align_t) char buffer_[4096];
+};
 
 struct Request {
-    string method, path, http_version;
+    typedef std::pmr::polymorphic_allocator<char> allocator_type;
+
+    explicit Request(allocator_type allocator = {})
+        : method(allocator), target(allocator), path(allocator), http_version(allocator), header(allocator) {}
+
+    std::pmr::string method;
+    std::pmr::string target;            // 请求行中原样的 request-target, 反向代理转发时使用
+    std::pmr::string path;              // 去掉查询、百分号解码并去掉 "." 和 ".." 以后的路径, 路由、缓存和静态文件都用它
+    std::pmr::string http_version;
+    size_t query_begin = 0;             // 查询在 target 中的起始位置
+    http::Method method_id = http::Method::unknown;
     shared_ptr<istream> content;
-    unordered_map<string, string> header;
+    shared_ptr<MultipartForm> form;     // 路径注册在 multipart_ 中的表单请求, 这时 content 为空
+    long long content_length = -1;      // 没有 Content-Length 头时为 -1
+    http::HeaderMap header;             // 请求头的名字不区分大小写
+    RequestTrace trace;
+
+    // '?' 之后的部分, 没有解码
+    std::string_view query() const { return std::string_view(target).substr(query_begin); }
+
+    // 查找查询参数, 值解码后写入 value (一般用处理函数的 arena 构造); 参数不存在时返回 false
+    bool query_param(std::string_view name, std::pmr::string& value) const { return http::query_param(query(), name, value); }
 };
 
 class HTTPServer {
 public:
-    unordered_map<string, unordered_map<string, function<void(ostream&, const Request&, const smatch&)>>> resources_;
+    unordered_map<string, http::MethodMap<function<void(Response&, const Request&, const smatch&, std::pmr::memory_resource&)>>> resources_;
+
+    // resources_ 中没有匹配的路径时使用, 比如静态文件
+    http::MethodMap<function<void(Response&, const Request&, const smatch&, std::pmr::memory_resource&)>> default_resource_;
+
+    // 静态文件 (web 目录) 的路径解析和打开缓存
+    shared_ptr<FileCache> file_cache_;
+
+    // 静态文件的目录下没有 index.html 时是否返回目录列表, 默认为 false, 返回 404 (不暴露目录中的文件名)
+    bool autoindex_ = false;
+
+    // 不为空时按客户端 IP 限流, 超过限制的请求在路由之前直接返回 429
+    shared_ptr<RateLimiter> rate_limiter_;
+
+    // 不为空时记录慢请求各阶段的耗时
+    shared_ptr<Tracer> tracer_;
+
+    // 大响应的发送方式
+    SendOptions send_options_;
+
+    // 不为空时把收到的请求原样录制下来, 用 tools/replay 重放
+    shared_ptr<CaptureWriter> capture_;
+
+    // 多进程模式下指向这个 worker 在共享内存中的计数, 为空时不统计
+    WorkerStats* stats_ = nullptr;
+
+    // 按路径 (正则) 注册的 WebSocket 处理函数, GET 请求带 Upgrade: websocket 时在路由之前检查
+    unordered_map<string, WebSocket::Handler> websocket_;
+    WebSocket::Options websocket_options_;
+
+    // 按路径 (正则) 注册的 Server-Sent Events, 匹配的 GET 请求保持连接, 由 on_open 订阅 Topic
+    unordered_map<string, EventStream::Handler> event_streams_;
+    EventStream::Options event_stream_options_;
+
+    // 按路径 (正则) 注册的 multipart/form-data 上传, 请求体边读边解析, 文件直接写入临时文件,
+    // 处理函数从 request.form 取得字段, 不再读取 content
+    unordered_map<string, MultipartForm::Options> multipart_;
+
+    // 按路径 (正则) 限制请求体的大小 (字节), Content-Length 超过时在读取请求体之前返回 413,
+    // 比如反向代理的路径, 请求体要整个读进内存以后才转发
+    unordered_map<string, size_t> max_body_;
     
+    typedef generic::stream_protocol::socket socket_type;
+    typedef basic_socket_acceptor<generic::stream_protocol> acceptor_type;
+
     HTTPServer(boost::asio::io_context&, unsigned short, size_t, size_t, size_t);
+
+    HTTPServer(boost::asio::io_context&, const std::vector<Listener>&, size_t, size_t, size_t);
     
     void start();
+
+    // 多进程模式下在 fork 前后调用 (同 io_context::notify_fork), 子进程中还要换掉 FileCache 的 inotify
+    void notify_fork(boost::asio::io_context::fork_event event);
             
 private:
     io_context &io_;
-    ip::tcp::endpoint endpoint_;
-    ip::tcp::acceptor acceptor_;
+    std::vector<std::pair<shared_ptr<acceptor_type>, bool>> acceptors_;   // bool 表示是否为 TCP
     size_t num_threads_;
     std::vector<std::thread> threads_;
 
+    // start() 时由 resources_ 生成, 指向 resources_ 中的处理函数表
+    std::vector<std::pair<std::regex, http::MethodMap<function<void(Response&, const Request&, const smatch&, std::pmr::memory_resource&)>>*>> routes_;
+    std::vector<std::pair<std::regex, const WebSocket::Handler*>> websocket_routes_;
+    std::vector<std::pair<std::regex, const EventStream::Handler*>> event_stream_routes_;
+    std::vector<std::pair<std::regex, const MultipartForm::Options*>> multipart_routes_;
+    std::vector<std::pair<std::regex, size_t>> max_body_routes_;
+
     size_t request_timeout_ = 5;
     size_t content_timeout_ = 300;
 
-    void accept();
+    // 处理函数调用 Response::defer() 以后完成这个请求的对象
+    class Exchange;
+
+    void listen(const Listener& listener);
 
-    void process_request_and_respond(shared_ptr<ip::tcp::socket> socket);
+    void accept(shared_ptr<acceptor_type> acceptor, bool tcp);
 
-    shared_ptr<deadline_timer> set_socket_timeout(shared_ptr<ip::tcp::socket> socket, size_t time);
+    void process_request_and_respond(shared_ptr<socket_type> socket, shared_ptr<Arena> arena);
+
+    shared_ptr<deadline_timer> set_socket_timeout(shared_ptr<socket_type> socket, size_t time);
     
-    void respond(shared_ptr<ip::tcp::socket> socket, shared_ptr<Request> request);
+    void respond(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<Arena> arena);
+
+    // 发送处理函数填好的响应, 发送完以后继续读取这个连接上的下一个请求
+    void send(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<Response> response, shared_ptr<Arena> arena);
+
+    // 发送预先生成的错误响应 (400 / 413 / 429 / 500) 后关闭连接
+    void reject(shared_ptr<socket_type> socket, int status = 429);
+
+    // 是 WebSocket 握手时完成握手并把连接交给 WebSocket, 返回 false 表示按普通请求处理
+    bool upgrade(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<streambuf> read_buffer, shared_ptr<Arena> arena);
+
+    // 路径注册为事件流时把连接交给 EventStream, 返回 false 表示按普通请求处理
+    bool subscribe(shared_ptr<socket_type> socket, shared_ptr<Request> request);
+
+    // 每次读入不超过 64KB 交给 request->form 解析, remaining 是还没有从 socket 读取的字节数
+    void read_form(shared_ptr<socket_type> socket, shared_ptr<Request> request, shared_ptr<streambuf> read_buffer,
+                   shared_ptr<Arena> arena, size_t remaining, shared_ptr<deadline_timer> timer);
 
-    Request parse_request(istream& stream);
+    void parse_request(istream& stream, Request& request, Arena& arena);
 
 };
 
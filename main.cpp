@@ -1,4 +1,10 @@
 #include "httpserver.hpp"
+#include "proxy.hpp"
+#include "bundle.hpp"
+#include "cache.hpp"
+#include "capture.hpp"
+#include "master.hpp"
+#include "ratelimit.hpp"
 
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
@@ -10,6 +16,7 @@ int main() {
     size_t request_timeout = 5;
     size_t content_timeout = 300;
 
+    boost::property_tree::ptree pt;
     string config_path = "./config.json";
     ifstream config(config_path, ios::in);
     if (config) {
@@ -17,7 +24,6 @@ int main() {
         ss << config.rdbuf();
         config.close();
         try {
-            boost::property_tree::ptree pt;
             read_json(ss, pt);
 
             port =            pt.get<unsigned short>("port");
@@ -30,12 +36,266 @@ int main() {
         }
     }
 
+    // 多个监听地址, 比如 "listeners" : [{ "type" : "tcp", "address" : "::", "port" : 8080 }, { "type" : "unix", "path" : "/tmp/httpserver.sock" }]
+    // 没有配置时只监听 IPv4 的 port
+    std::vector<Listener> listeners;
+    if (auto items = pt.get_child_optional("listeners")) {
+        for (auto& item : *items) {
+            auto& l = item.second;
+            Listener listener;
+            listener.type =         l.get<string>("type", listener.type);
+            listener.address =      l.get<string>("address", listener.address);
+            listener.port =         l.get<unsigned short>("port", port);
+            listener.path =         l.get<string>("path", listener.path);
+            listener.backlog =      l.get<int>("backlog", listener.backlog);
+            listener.v6only =       l.get<bool>("v6only", listener.v6only);
+            listener.fastopen =     l.get<int>("fastopen", listener.fastopen);
+            listener.defer_accept = l.get<int>("defer_accept", listener.defer_accept);
+            listener.rcvbuf =       l.get<int>("rcvbuf", listener.rcvbuf);
+            listener.sndbuf =       l.get<int>("sndbuf", listener.sndbuf);
+            listeners.push_back(listener);
+        }
+    }
+    else {
+        listeners.emplace_back();
+        listeners.back().port = port;
+    }
+
     boost::asio::io_context io;
 
-    std::cout << "httpserver in port: " << port << std::endl;
+    for (auto& listener : listeners) {
+        if (listener.type == "unix")
+            std::cout << "httpserver in unix socket: " << listener.path << std::endl;
+        else
+            std::cout << "httpserver in " << listener.address << " port: " << listener.port << std::endl;
+    }
     std::cout << "request_timeout is : " << request_timeout;
     std::cout << ", content_timeout is : " << content_timeout << std::endl;
-    HTTPServer httpserver(io, port, num_threads, request_timeout, content_timeout);
+    HTTPServer httpserver(io, listeners, num_threads, request_timeout, content_timeout);
+
+    // 静态文件的目录下没有 index.html 时返回目录列表, 比如 "autoindex" : true; 默认不返回
+    httpserver.autoindex_ = pt.get<bool>("autoindex", httpserver.autoindex_);
+
+    // 反向代理, 比如 "proxy" : [{ "pattern" : "^/api/.*", "upstreams" : ["127.0.0.1:9000", "127.0.0.1:9001"] }]
+    if (auto proxies = pt.get_child_optional("proxy")) {
+        for (auto& item : *proxies) {
+            auto& p = item.second;
+            std::vector<string> upstreams;
+            for (auto& u : p.get_child("upstreams"))
+                upstreams.push_back(u.second.get_value<string>());
+
+            auto proxy = std::make_shared<ReverseProxy>(upstreams,
+                p.get<size_t>("max_idle", 16), p.get<size_t>("max_fails", 3),
+                p.get<size_t>("fail_timeout", 10), p.get<size_t>("timeout", 30));
+
+            string pattern = p.get<string>("pattern");
+            for (auto method : {"GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS"})
+                httpserver.resources_[pattern][method] = proxy->handler();
+            // 转发前请求体整个保存在内存中, 默认不超过 1MB, 0 表示不限制
+            if (size_t max_body = p.get<size_t>("max_body", 1024 * 1024))
+                httpserver.max_body_[pattern] = max_body;
+            std::cout << "proxy " << pattern << " -> " << upstreams.size() << " upstream(s)" << std::endl;
+        }
+    }
+
+    // 动态响应的微缓存, 比如 "micro_cache" : [{ "pattern" : "^/$", "ttl" : 1, "stale" : 10, "vary" : ["Accept-Encoding"] }]
+    if (auto rules = pt.get_child_optional("micro_cache")) {
+        auto cache = std::make_shared<ResponseCache>(io, pt.get<size_t>("micro_cache_shards", 16),
+                                                     pt.get<size_t>("micro_cache_entries", 4096));
+        for (auto& item : *rules) {
+            auto& r = item.second;
+            string pattern = r.get<string>("pattern");
+            string method = r.get<string>("method", "GET");
+
+            auto resource = httpserver.resources_.find(pattern);
+            if (resource == httpserver.resources_.end() || resource->second.count(method) == 0) {
+                std::cerr << "micro_cache: no handler for " << method << " " << pattern << std::endl;
+                continue;
+            }
+
+            ResponseCache::Rule rule;
+            rule.ttl = r.get<double>("ttl", 1);
+            rule.stale = r.get<double>("stale", 0);
+            if (auto vary = r.get_child_optional("vary"))
+                for (auto& v : *vary)
+                    rule.vary.push_back(v.second.get_value<string>());
+
+            auto& handler = resource->second[method];
+            handler = cache->wrap(pattern, handler, rule);
+            std::cout << "micro_cache " << method << " " << pattern << " ttl " << rule.ttl << "s" << std::endl;
+        }
+    }
+
+    // 限流, 比如 "rate_limit" : { "rate" : 100, "burst" : 200, "routes" : [{ "pattern" : "^/api/.*", "rate" : 10, "burst" : 20 }] }
+    if (auto limits = pt.get_child_optional("rate_limit")) {
+        RateLimiter::Limit per_ip{limits->get<double>("rate", 0), limits->get<double>("burst", 0)};
+        auto limiter = std::make_shared<RateLimiter>(per_ip, limits->get<size_t>("capacity", 65536),
+                                                     limits->get<size_t>("shards", 16));
+        if (auto routes = limits->get_child_optional("routes")) {
+            for (auto& item : *routes) {
+                auto& r = item.second;
+                RateLimiter::Limit limit{r.get<double>("rate"), r.get<double>("burst", 0)};
+                limiter->add_route(r.get<string>("pattern"), limit);
+            }
+        }
+        httpserver.rate_limiter_ = limiter;
+        std::cout << "rate_limit " << per_ip.rate << " req/s per ip, burst " << limiter->per_ip().burst << std::endl;
+    }
+
+    // 慢请求采样, 比如 "trace" : { "slow_ms" : 100, "capacity" : 1024, "admin_path" : "/_trace", "file" : "trace.json" }
+    // GET /_trace 返回文本, GET /_trace/chrome 返回 Chrome trace JSON, kill -USR1 写入 file
+    boost::asio::signal_set dump_signal(io);
+    std::function<void(const boost::system::error_code&, int)> on_dump_signal;
+    if (auto trace = pt.get_child_optional("trace")) {
+        auto tracer = std::make_shared<Tracer>(trace->get<double>("slow_ms", 100), trace->get<size_t>("capacity", 1024));
+        httpserver.tracer_ = tracer;
+
+        string admin_path = trace->get<string>("admin_path", "/_trace");
+        if (!admin_path.empty()) {
+            httpserver.resources_["^" + admin_path + "$"]["GET"] = [tracer](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+                response.header("Content-Type", "text/plain");
+                tracer->dump_text(response);
+            };
+            httpserver.resources_["^" + admin_path + "/chrome$"]["GET"] = [tracer](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+                response.header("Content-Type", "application/json");
+                tracer->dump_chrome(response);
+            };
+        }
+
+        string file = trace->get<string>("file", "");
+        if (!file.empty()) {
+            dump_signal.add(SIGUSR1);
+            on_dump_signal = [&dump_signal, &on_dump_signal, tracer, file](const boost::system::error_code& ec, int) {
+                if (ec)
+                    return;
+                if (!tracer->dump_file(file))
+                    std::cerr << "trace: could not write " << file << std::endl;
+                dump_signal.async_wait(on_dump_signal);
+            };
+            dump_signal.async_wait(on_dump_signal);
+        }
+        std::cout << "trace requests slower than " << trace->get<double>("slow_ms", 100) << " ms" << std::endl;
+    }
+
+    // 静态文件改为从打包好的文件中读取, 比如 "bundle" : { "file" : "web.bundle", "populate" : true, "huge_pages" : false }
+    // 用 tools/pack_bundle 生成, web 目录有变化时需要重新打包并重启
+    if (auto b = pt.get_child_optional("bundle")) {
+        auto bundle = std::make_shared<AssetBundle>(b->get<string>("file"), b->get<bool>("populate", false),
+                                                    b->get<bool>("huge_pages", false));
+        httpserver.default_resource_["GET"] = [bundle](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+            bundle->serve(response, request, arena);
+        };
+        std::cout << "bundle " << b->get<string>("file") << ", " << bundle->size() << " files" << std::endl;
+    }
+
+    // 大响应的发送方式, 比如 "send" : { "cork_min" : 65536, "zerocopy_min" : 1048576 }
+    if (auto send = pt.get_child_optional("send")) {
+        auto& options = httpserver.send_options_;
+        options.cork_min = send->get<size_t>("cork_min", options.cork_min);
+        options.zerocopy_min = send->get<size_t>("zerocopy_min", options.zerocopy_min);
+        std::cout << "send cork_min " << options.cork_min << ", zerocopy_min " << options.zerocopy_min << std::endl;
+    }
+
+    // WebSocket, 比如 "websocket" : { "max_message" : 1048576, "deflate" : true, "deflate_min" : 64 }
+    if (auto ws = pt.get_child_optional("websocket")) {
+        auto& options = httpserver.websocket_options_;
+        options.max_message = ws->get<size_t>("max_message", options.max_message);
+        options.deflate = ws->get<bool>("deflate", options.deflate);
+        options.deflate_min = ws->get<size_t>("deflate_min", options.deflate_min);
+        std::cout << "websocket max_message " << options.max_message << (options.deflate ? ", permessage-deflate" : "") << std::endl;
+    }
+
+    // 文件上传, 比如 "upload" : { "path" : "/upload", "dir" : "uploads", "spool_dir" : "/tmp", "max_size" : 1073741824 }
+    // 请求体边读边解析, 文件先写入 spool_dir 下的临时文件; 设置了 dir 时按上传的文件名移动过去 (两者应在同一个文件系统上)
+    if (auto upload = pt.get_child_optional("upload")) {
+        string path = upload->get<string>("path", "/upload");
+        auto& options = httpserver.multipart_["^" + path + "$"];
+        options.spool_dir = upload->get<string>("spool_dir", options.spool_dir);
+        options.max_size = upload->get<size_t>("max_size", options.max_size);
+        options.max_field = upload->get<size_t>("max_field", options.max_field);
+        options.max_parts = upload->get<size_t>("max_parts", options.max_parts);
+        string dir = upload->get<string>("dir", "");
+        httpserver.resources_["^" + path + "$"]["POST"] = [dir](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+            if (!request.form) {
+                response.status(400) << "expected multipart/form-data" << std::endl;
+                return;
+            }
+            response.header("Content-Type", "text/plain");
+            for (auto& field : request.form->fields()) {
+                response << field.name << " " << field.size;
+                // 只取文件名的最后一部分, 不允许写到 dir 之外
+                auto name = boost::filesystem::path(field.filename).filename().string();
+                if (!dir.empty() && !field.path.empty() && !name.empty() && name != "." && name != "..") {
+                    if (std::rename(field.path.c_str(), (dir + "/" + name).c_str()) == 0)
+                        response << " " << name;
+                }
+                response << std::endl;
+            }
+        };
+        std::cout << "upload " << path << ", spool_dir " << options.spool_dir << std::endl;
+    }
+
+    // Server-Sent Events, 比如 "sse" : { "path" : "/events", "publish_path" : "/events/publish", "max_queued" : 1048576, "heartbeat" : 15 }
+    // GET path 订阅, POST publish_path 的请求体作为一条事件广播给所有订阅者
+    if (auto sse = pt.get_child_optional("sse")) {
+        auto topic = std::make_shared<Topic>();
+        httpserver.event_stream_options_.max_queued = sse->get<size_t>("max_queued", httpserver.event_stream_options_.max_queued);
+        httpserver.event_stream_options_.heartbeat = sse->get<size_t>("heartbeat", httpserver.event_stream_options_.heartbeat);
+        string path = sse->get<string>("path", "/events");
+        httpserver.event_streams_["^" + path + "$"].on_open = [topic](std::shared_ptr<EventStream> stream, const Request& request) {
+            topic->subscribe(stream);
+        };
+
+        string publish_path = sse->get<string>("publish_path", "");
+        if (!publish_path.empty()) {
+            httpserver.resources_["^" + publish_path + "$"]["POST"] = [topic](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+                std::pmr::string data(&arena);
+                if (request.content)
+                    data.assign(std::istreambuf_iterator<char>(*request.content), std::istreambuf_iterator<char>());
+                response.header("Content-Type", "text/plain");
+                response << topic->publish(data) << " subscribers" << std::endl;
+            };
+        }
+        std::cout << "sse " << path << ", max_queued " << httpserver.event_stream_options_.max_queued << std::endl;
+    }
+
+    // 多进程模式, 比如 "workers" : 4, "worker_affinity" : "numa", "worker_status_path" : "/_workers"
+    // 主进程绑定监听地址后 fork 出 workers 个进程, 每个进程按 num_threads 运行自己的 io_context, 异常退出的 worker 由主进程重新 fork;
+    // worker_affinity 为 "cpu" 或 "numa" 时按 CPU 或 NUMA 节点轮流绑定。限流、微缓存、SSE 的订阅者等状态在每个 worker 中各自独立
+    std::unique_ptr<Master> master;
+    int worker = -1;
+    if (size_t workers = pt.get<size_t>("workers", 0)) {
+        master = std::make_unique<Master>(workers, Master::parse_affinity(pt.get<string>("worker_affinity", "none")),
+            [&httpserver](boost::asio::io_context::fork_event event) {
+                httpserver.notify_fork(event);
+            });
+
+        string status_path = pt.get<string>("worker_status_path", "");
+        if (!status_path.empty()) {
+            httpserver.resources_["^" + status_path + "$"]["GET"] = [m = master.get()](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+                response.header("Content-Type", "text/plain");
+                response << m->status();
+            };
+        }
+        std::cout << "workers " << workers << std::endl;
+
+        worker = master->run();
+        if (worker < 0)
+            return 0;
+        httpserver.stats_ = &master->stats(worker);
+    }
+
+    // 录制收到的请求, 比如 "capture" : { "file" : "capture.bin", "max_body" : 1048576 }
+    // 用 tools/replay 按原来的连接和时间重放; 多进程模式下每个 worker 写自己的文件, 文件名后面加上 worker 的编号
+    if (auto c = pt.get_child_optional("capture")) {
+        string file = c->get<string>("file");
+        if (worker >= 0)
+            file += "." + std::to_string(worker);
+        httpserver.capture_ = std::make_shared<CaptureWriter>(file, c->get<size_t>("max_body", 1024 * 1024),
+                                                              c->get<size_t>("max_buffer", 64 * 1024 * 1024));
+        std::cout << "capture requests to " << file << std::endl;
+    }
+
     httpserver.start();
     
     return 0;
@@ -0,0 +1,269 @@
+#include "master.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+    // "0-3,8-11" 这样的 CPU / 节点列表
+    std::vector<int> parse_list(const std::string& s) {
+        std::vector<int> list;
+        std::istringstream in(s);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            int first, last;
+            int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (n < 1)
+                continue;
+            if (n == 1)
+                last = first;
+            for (int i = first; i <= last; i++)
+                list.push_back(i);
+        }
+        return list;
+    }
+
+    std::string read_line(const std::string& path) {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+
+    // 当前进程允许使用的 CPU, 在容器中或者被 taskset 限制时不是全部
+    std::vector<int> allowed_cpus() {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            return cpus;
+        for (int i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &set))
+                cpus.push_back(i);
+        return cpus;
+    }
+
+    std::string describe(int status) {
+        if (WIFSIGNALED(status))
+            return "killed by signal " + std::to_string(WTERMSIG(status));
+        return "exited with status " + std::to_string(WEXITSTATUS(status));
+    }
+}
+
+Master::Affinity Master::parse_affinity(const std::string& name) {
+    if (name == "cpu")
+        return Affinity::cpu;
+    if (name == "numa")
+        return Affinity::numa;
+    return Affinity::none;
+}
+
+Master::Master(size_t workers, Affinity affinity, ForkHandler notify_fork)
+    : workers_(workers), affinity_(affinity), notify_fork_(std::move(notify_fork)) {
+
+    // 匿名共享映射在 fork 以后父子进程看到的是同一块内存
+    void* p = ::mmap(nullptr, sizeof(WorkerStats) * workers_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::runtime_error("could not map worker stats");
+    stats_ = static_cast<WorkerStats*>(p);
+    for (size_t i = 0; i < workers_; i++)
+        new (&stats_[i]) WorkerStats();
+
+    auto cpus = allowed_cpus();
+    if (affinity_ == Affinity::cpu) {
+        for (int cpu : cpus)
+            cpu_sets_.push_back({cpu});
+    }
+    else if (affinity_ == Affinity::numa) {
+        // 不依赖 libnuma, 节点和 CPU 的对应关系从 sysfs 读取
+        for (int node : parse_list(read_line("/sys/devices/system/node/online"))) {
+            std::vector<int> node_cpus;
+            for (int cpu : parse_list(read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))) {
+                for (int allowed : cpus)
+                    if (allowed == cpu)
+                        node_cpus.push_back(cpu);
+            }
+            // 没有 CPU 的节点 (只有内存) 不分配 worker
+            if (!node_cpus.empty())
+                cpu_sets_.push_back(std::move(node_cpus));
+        }
+        if (cpu_sets_.empty())
+            std::cerr << "workers: no NUMA information, workers are not bound" << std::endl;
+    }
+}
+
+Master::~Master() {
+    ::munmap(stats_, sizeof(WorkerStats) * workers_);
+}
+
+int Master::run() {
+    // 主进程中这几个信号由 sigtimedwait 同步处理, 不会打断其他操作; worker 中恢复原来的信号屏蔽
+    // SIGCHLD 被屏蔽时仍然会挂起等待处理, 不会因为默认的忽略而丢失
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+    typedef std::chrono::steady_clock clock;
+    std::vector<pid_t> pids(workers_, 0);
+    std::vector<clock::time_point> started(workers_), restart_at(workers_);
+
+    for (size_t i = 0; i < workers_; i++) {
+        pid_t pid = spawn(i, old_mask);
+        if (pid == 0)
+            return static_cast<int>(i);
+        pids[i] = pid > 0 ? pid : 0;
+        started[i] = clock::now();
+        restart_at[i] = clock::now() + std::chrono::seconds(1);
+    }
+
+    for (;;) {
+        int status;
+        pid_t pid;
+        while ((pid = ::waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t i = 0; i < workers_; i++) {
+                if (pids[i] != pid)
+                    continue;
+                std::cerr << "worker " << i << " (pid " << pid << ") " << describe(status) << ", restarting" << std::endl;
+                pids[i] = 0;
+                stats_[i].pid.store(0, std::memory_order_relaxed);
+                // 启动后不到 1 秒就退出 (比如每个请求都会触发的崩溃) 时推迟 1 秒再 fork, 避免不停地 fork
+                auto now = clock::now();
+                restart_at[i] = now - started[i] < std::chrono::seconds(1) ? now + std::chrono::seconds(1) : now;
+            }
+        }
+
+        auto now = clock::now();
+        for (size_t i = 0; i < workers_; i++) {
+            if (pids[i] != 0 || restart_at[i] > now)
+                continue;
+            pid_t pid = spawn(i, old_mask);
+            if (pid == 0)
+                return static_cast<int>(i);
+            if (pid < 0) {
+                restart_at[i] = now + std::chrono::seconds(1);
+                continue;
+            }
+            pids[i] = pid;
+            started[i] = now;
+            stats_[i].restarts.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // 等待期间到期的重启最多推迟 1 秒
+        timespec timeout = {1, 0};
+        int signal = sigtimedwait(&mask, nullptr, &timeout);
+        if (signal == SIGTERM || signal == SIGINT) {
+            stop_workers(pids);
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            return -1;
+        }
+    }
+}
+
+pid_t Master::spawn(size_t worker, const sigset_t& old_mask) {
+    pid_t master = ::getpid();
+    notify_fork_(boost::asio::io_context::fork_prepare);
+    pid_t pid = ::fork();
+    if (pid != 0) {
+        notify_fork_(boost::asio::io_context::fork_parent);
+        if (pid < 0) {
+            std::perror("fork");
+            return pid;
+        }
+        stats_[worker].pid.store(pid, std::memory_order_relaxed);
+        stats_[worker].started.store(std::time(nullptr), std::memory_order_relaxed);
+        return pid;
+    }
+
+    // 主进程被 SIGKILL 等方式结束时 worker 也退出, 否则它们会继续占用监听 socket
+    ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (::getppid() != master)
+        ::_exit(0);
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+    bind_cpus(worker);
+    notify_fork_(boost::asio::io_context::fork_child);
+    return 0;
+}
+
+void Master::bind_cpus(size_t worker) {
+    if (cpu_sets_.empty())
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpu_sets_[worker % cpu_sets_.size()])
+        CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        std::perror("sched_setaffinity");
+}
+
+void Master::stop_workers(const std::vector<pid_t>& pids) {
+    size_t alive = 0;
+    for (pid_t pid : pids) {
+        if (pid != 0 && ::kill(pid, SIGTERM) == 0)
+            alive++;
+    }
+
+    // 最多等 5 秒, 之后还没有退出的 worker 用 SIGKILL 结束
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    while (alive > 0) {
+        int status;
+        if (::waitpid(-1, &status, WNOHANG) > 0) {
+            alive--;
+            continue;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            for (pid_t pid : pids)
+                if (pid != 0)
+                    ::kill(pid, SIGKILL);
+            while (::waitpid(-1, &status, 0) > 0)
+                ;
+            break;
+        }
+        timespec timeout = {0, 100 * 1000 * 1000};
+        sigtimedwait(&mask, nullptr, &timeout);
+    }
+    for (size_t i = 0; i < workers_; i++)
+        stats_[i].pid.store(0, std::memory_order_relaxed);
+}
+
+std::string Master::status() const {
+    std::ostringstream out;
+    out << "worker\tpid\trestarts\tuptime\tconnections\trequests\tbytes_sent\n";
+    uint64_t connections = 0, requests = 0, bytes_sent = 0;
+    uint32_t restarts = 0;
+    auto now = std::time(nullptr);
+    for (size_t i = 0; i < workers_; i++) {
+        auto& s = stats_[i];
+        int pid = s.pid.load(std::memory_order_relaxed);
+        out << i << "\t" << pid << "\t" << s.restarts.load(std::memory_order_relaxed) << "\t";
+        if (pid != 0)
+            out << now - s.started.load(std::memory_order_relaxed) << "s";
+        else
+            out << "-";
+        out << "\t" << s.connections.load(std::memory_order_relaxed)
+            << "\t" << s.requests.load(std::memory_order_relaxed)
+            << "\t" << s.bytes_sent.load(std::memory_order_relaxed) << "\n";
+        connections += s.connections.load(std::memory_order_relaxed);
+        requests += s.requests.load(std::memory_order_relaxed);
+        bytes_sent += s.bytes_sent.load(std::memory_order_relaxed);
+        restarts += s.restarts.load(std::memory_order_relaxed);
+    }
+    out << "total\t-\t" << restarts << "\t-\t" << connections << "\t" << requests << "\t" << bytes_sent << "\n";
+    return out.str();
+}
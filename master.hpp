@@ -0,0 +1,75 @@
+#ifndef MASTER_HPP
+#define	MASTER_HPP
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <boost/asio.hpp>
+
+
+// 一个 worker 的计数, 放在 fork 之前映射的共享内存中, 所有进程都能读到
+// 每个 worker 只写自己的一项, 各占一个 cache line, 不互相影响
+struct alignas(64) WorkerStats {
+    std::atomic<int> pid{0};
+    std::atomic<uint32_t> restarts{0};      // 这一项的 worker 退出后被重新 fork 的次数
+    std::atomic<int64_t> started{0};        // 当前进程的启动时间 (time(), 秒)
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> bytes_sent{0};
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "WorkerStats must be lock free to live in shared memory");
+
+// 多进程模式: 主进程绑定好监听地址后 fork 出若干 worker, 每个 worker 各自运行 HTTPServer::start(),
+// 共用同一组监听 socket, 由内核把新连接分给正在 accept 的 worker。
+// 一个 worker 崩溃只断开它自己的连接, 主进程重新 fork 一个; 主进程不处理请求, 只负责监视和退出时结束 worker
+class Master {
+public:
+    // worker 绑定的 CPU: 不绑定, 按 CPU 轮流, 按 NUMA 节点轮流 (绑定到节点的全部 CPU, 新分配的内存默认在本节点上)
+    enum class Affinity { none, cpu, numa };
+
+    // fork 前后的通知, 用来调用 io_context::notify_fork 等
+    typedef std::function<void(boost::asio::io_context::fork_event)> ForkHandler;
+
+    Master(size_t workers, Affinity affinity, ForkHandler notify_fork);
+    ~Master();
+
+    Master(const Master&) = delete;
+    Master& operator=(const Master&) = delete;
+
+    // 在 worker 进程中返回 worker 的编号 (0 ~ workers - 1);
+    // 主进程一直监视 worker, 收到 SIGTERM / SIGINT 时结束所有 worker 并返回 -1
+    int run();
+
+    size_t workers() const { return workers_; }
+
+    WorkerStats& stats(size_t worker) { return stats_[worker]; }
+
+    // 所有 worker 的计数, 每个 worker 一行加上合计, 任何一个进程都可以调用
+    std::string status() const;
+
+    static Affinity parse_affinity(const std::string& name);
+
+private:
+    size_t workers_;
+    Affinity affinity_;
+    ForkHandler notify_fork_;
+    WorkerStats* stats_ = nullptr;
+    std::vector<std::vector<int>> cpu_sets_;    // 按 affinity_ 分组的 CPU, worker i 使用第 i % size() 组
+
+    // 返回 0 表示在 worker 进程中
+    pid_t spawn(size_t worker, const sigset_t& old_mask);
+
+    void bind_cpus(size_t worker);
+
+    // SIGTERM 结束所有 worker 并等待它们退出
+    void stop_workers(const std::vector<pid_t>& pids);
+};
+
+#endif	/* MASTER_HPP */
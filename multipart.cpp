@@ -0,0 +1,384 @@
+#include "multipart.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "http_tables.hpp"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+namespace {
+    const size_t max_header_size = 8 * 1024;
+
+    std::string_view trim(std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+            s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+            s.remove_suffix(1);
+        return s;
+    }
+
+    // 取出 "form-data; name=\"a\"; filename=\"b.txt\"" 这样的值中的参数, 引号中的内容原样返回
+    // 浏览器会把文件名中的引号编码成 %22, 不处理反斜杠转义
+    std::string_view parameter(std::string_view value, std::string_view key) {
+        size_t i = value.find(';');
+        while (i != std::string_view::npos) {
+            size_t eq = value.find('=', i + 1);
+            if (eq == std::string_view::npos)
+                break;
+            auto name = trim(value.substr(i + 1, eq - i - 1));
+            std::string_view result;
+            size_t j = eq + 1;
+            while (j < value.size() && value[j] == ' ')
+                j++;
+            if (j < value.size() && value[j] == '"') {
+                size_t close = value.find('"', j + 1);
+                result = value.substr(j + 1, close == std::string_view::npos ? std::string_view::npos : close - j - 1);
+                i = close == std::string_view::npos ? close : value.find(';', close);
+            }
+            else {
+                i = value.find(';', j);
+                result = trim(value.substr(j, i == std::string_view::npos ? i : i - j));
+            }
+            if (http::iequals(name, key))
+                return result;
+        }
+        return {};
+    }
+}
+
+MultipartParser::MultipartParser(std::string_view boundary) : delimiter_("\r\n--") {
+    delimiter_.append(boundary);
+    // 第一个分隔符可以出现在最开头, 当作前面已经有一个 "\r\n"
+    carry_ = "\r\n";
+}
+
+std::string_view MultipartParser::boundary(std::string_view content_type) {
+    const std::string_view type = "multipart/form-data";
+    if (content_type.size() < type.size() || !http::iequals(content_type.substr(0, type.size()), type))
+        return {};
+    auto boundary = parameter(content_type, "boundary");
+    // RFC 2046: 1 到 70 个字符
+    if (boundary.empty() || boundary.size() > 70)
+        return {};
+    return boundary;
+}
+
+size_t MultipartParser::find(const char* s, size_t size, std::string_view needle) {
+    const size_t n = needle.size();
+    if (size < n)
+        return std::string_view::npos;
+    const size_t last = n - 1;
+    size_t i = 0;
+
+    // 同时比较首字节和尾字节, 分隔符以 '\r' 开头, 在一般的数据中两者同时命中的位置很少, 命中后再比较中间部分
+#ifdef __AVX2__
+    const __m256i first32 = _mm256_set1_epi8(needle[0]);
+    const __m256i last32 = _mm256_set1_epi8(needle[last]);
+    for (; i + 32 + last <= size; i += 32) {
+        __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + last));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first32), _mm256_cmpeq_epi8(tail, last32)));
+        while (mask != 0) {
+            unsigned bit = __builtin_ctz(mask);
+            if (std::memcmp(s + i + bit + 1, needle.data() + 1, n - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i first16 = _mm_set1_epi8(needle[0]);
+    const __m128i last16 = _mm_set1_epi8(needle[last]);
+    for (; i + 16 + last <= size; i += 16) {
+        __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + last));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first16), _mm_cmpeq_epi8(tail, last16)));
+        while (mask != 0) {
+            unsigned bit = __builtin_ctz(mask);
+            if (std::memcmp(s + i + bit + 1, needle.data() + 1, n - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + n <= size; i++) {
+        if (s[i] == needle[0] && s[i + last] == needle[last] && std::memcmp(s + i + 1, needle.data() + 1, n - 2) == 0)
+            return i;
+    }
+    return std::string_view::npos;
+}
+
+bool MultipartParser::feed(const char* data, size_t size) {
+    while (size > 0 && state_ != State::error) {
+        switch (state_) {
+        case State::preamble:
+        case State::body: {
+            size_t n = body(data, size);
+            data += n;
+            size -= n;
+            break;
+        }
+        case State::boundary_line: {
+            // 分隔符后面是 "--" 表示结束, 否则是可选的空白和 "\r\n"
+            auto newline = static_cast<const char*>(std::memchr(data, '\n', size));
+            size_t n = newline ? newline - data + 1 : size;
+            if (line_.size() + n > 1024) {
+                state_ = State::error;
+                break;
+            }
+            line_.append(data, n);
+            data += n;
+            size -= n;
+            if (line_.size() >= 2 && line_.compare(0, 2, "--") == 0) {
+                line_.clear();
+                state_ = State::epilogue;
+                break;
+            }
+            if (!newline)
+                break;
+            if (line_.size() < 2 || line_[line_.size() - 2] != '\r' ||
+                !trim(std::string_view(line_).substr(0, line_.size() - 2)).empty()) {
+                state_ = State::error;
+                break;
+            }
+            // 头部以空行结束, 保留这一行的 "\r\n", 没有头部时紧接着就是 "\r\n"
+            line_ = "\r\n";
+            state_ = State::headers;
+            break;
+        }
+        case State::headers: {
+            size_t old = line_.size();
+            size_t n = std::min(size, max_header_size + 4 - old);
+            line_.append(data, n);
+            auto end = line_.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+            if (end == std::string::npos) {
+                if (line_.size() >= max_header_size + 4) {
+                    state_ = State::error;
+                    break;
+                }
+                data += n;
+                size -= n;
+                break;
+            }
+            size_t used = end + 4 - old;
+            data += used;
+            size -= used;
+            parse_headers(std::string_view(line_).substr(2, end >= 2 ? end - 2 : 0));
+            line_.clear();
+            state_ = State::body;
+            if (on_part_begin && !on_part_begin(part_))
+                state_ = State::error;
+            break;
+        }
+        case State::epilogue:
+            // 结束分隔符之后的内容忽略
+            return true;
+        case State::error:
+            break;
+        }
+    }
+    return state_ != State::error;
+}
+
+size_t MultipartParser::body(const char* data, size_t size) {
+    const size_t n = delimiter_.size();
+    if (!carry_.empty()) {
+        // 上一次末尾留下的字节加上这一次开头的 n - 1 个字节, 看分隔符是不是跨在两次之间
+        size_t take = std::min(size, n - 1);
+        line_.assign(carry_).append(data, take);
+        size_t pos = find(line_.data(), line_.size(), delimiter_);
+        if (pos != std::string::npos) {
+            size_t used = pos + n - carry_.size();
+            carry_.clear();
+            if (!emit(line_.data(), pos) || !delimited())
+                return size;
+            line_.clear();
+            return used;
+        }
+        if (take < n - 1) {
+            // 数据太少还不能确定, 只交出不可能是分隔符开头的部分
+            size_t keep = std::min(line_.size(), n - 1);
+            carry_.assign(line_, line_.size() - keep, keep);
+            emit(line_.data(), line_.size() - keep);
+            line_.clear();
+            return size;
+        }
+        // 以 carry_ 中某个位置开头的分隔符都会完整地落在上面的拼接中, carry_ 可以全部交出
+        line_.clear();
+        if (!emit(carry_.data(), carry_.size()))
+            return size;
+        carry_.clear();
+    }
+
+    size_t pos = find(data, size, delimiter_);
+    if (pos != std::string::npos) {
+        if (emit(data, pos))
+            delimited();
+        return pos + n;
+    }
+
+    // 末尾的 n - 1 个字节可能是分隔符的开头, 从其中第一个 '\r' 开始留到下一次
+    size_t tail = size > n - 1 ? size - (n - 1) : 0;
+    auto cr = static_cast<const char*>(std::memchr(data + tail, '\r', size - tail));
+    size_t keep_from = cr ? cr - data : size;
+    carry_.assign(data + keep_from, size - keep_from);
+    emit(data, keep_from);
+    return size;
+}
+
+bool MultipartParser::emit(const char* data, size_t size) {
+    // 第一个分隔符之前的内容 (preamble) 丢弃
+    if (state_ != State::body || size == 0 || !on_part_data)
+        return true;
+    if (!on_part_data(data, size)) {
+        state_ = State::error;
+        return false;
+    }
+    return true;
+}
+
+bool MultipartParser::delimited() {
+    if (state_ == State::body && on_part_end && !on_part_end()) {
+        state_ = State::error;
+        return false;
+    }
+    state_ = State::boundary_line;
+    return true;
+}
+
+void MultipartParser::parse_headers(std::string_view block) {
+    part_ = Part();
+    while (!block.empty()) {
+        auto end = block.find("\r\n");
+        auto line = block.substr(0, end);
+        block.remove_prefix(end == std::string_view::npos ? block.size() : end + 2);
+
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos)
+            continue;
+        auto name = trim(line.substr(0, colon));
+        auto value = trim(line.substr(colon + 1));
+        if (http::iequals(name, "Content-Disposition")) {
+            part_.name = parameter(value, "name");
+            part_.filename = parameter(value, "filename");
+        }
+        else if (http::iequals(name, "Content-Type")) {
+            part_.content_type = value;
+        }
+        part_.headers.emplace_back(name, value);
+    }
+}
+
+MultipartForm::MultipartForm(std::string_view boundary, const Options& options)
+    : options_(options), parser_(boundary) {
+    parser_.on_part_begin = [this](const MultipartParser::Part& part) {
+        return begin(part);
+    };
+    parser_.on_part_data = [this](const char* data, size_t size) {
+        return append(data, size);
+    };
+    parser_.on_part_end = [this]() {
+        return end();
+    };
+}
+
+MultipartForm::~MultipartForm() {
+    close_file();
+    // 处理函数已经 rename 走的文件 unlink 会失败, 忽略
+    for (auto& field : fields_) {
+        if (!field.path.empty())
+            ::unlink(field.path.c_str());
+    }
+}
+
+bool MultipartForm::feed(const char* data, size_t size) {
+    if (parser_.feed(data, size))
+        return true;
+    if (status_ == 200)
+        status_ = 400;
+    return false;
+}
+
+bool MultipartForm::finish() {
+    close_file();
+    if (!parser_.done()) {
+        status_ = 400;
+        return false;
+    }
+    return true;
+}
+
+const MultipartForm::Field* MultipartForm::find(std::string_view name) const {
+    for (auto& field : fields_) {
+        if (field.name == name)
+            return &field;
+    }
+    return nullptr;
+}
+
+bool MultipartForm::begin(const MultipartParser::Part& part) {
+    if (fields_.size() >= options_.max_parts) {
+        status_ = 413;
+        return false;
+    }
+    fields_.emplace_back();
+    auto& field = fields_.back();
+    field.name = part.name;
+    field.filename = part.filename;
+    field.content_type = part.content_type;
+    if (!part.filename.empty()) {
+        // 文件内容不经过内存, 直接从读缓冲区写入临时文件
+        field.path = options_.spool_dir + "/upload-XXXXXX";
+        fd_ = ::mkostemp(&field.path[0], O_CLOEXEC);
+        if (fd_ < 0) {
+            field.path.clear();
+            status_ = 500;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MultipartForm::append(const char* data, size_t size) {
+    auto& field = fields_.back();
+    field.size += size;
+    if (fd_ < 0) {
+        if (field.value.size() + size > options_.max_field) {
+            status_ = 413;
+            return false;
+        }
+        field.value.append(data, size);
+        return true;
+    }
+    while (size > 0) {
+        ssize_t n = ::write(fd_, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            status_ = 500;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool MultipartForm::end() {
+    close_file();
+    return true;
+}
+
+void MultipartForm::close_file() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef MULTIPART_HPP
+#define	MULTIPART_HPP
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+// multipart/form-data 的增量解析 (RFC 7578)
+// 数据可以按任意长度分多次喂入, 分段的头部和内容以回调的形式给出; 内容直接指向喂入的数据, 不拷贝。
+// 除了分段的头部 (最多 8KB) 之外只保留可能是半个分隔符的几十个字节, 内存占用和请求体的大小无关
+class MultipartParser {
+public:
+    struct Part {
+        std::string name;
+        std::string filename;       // 不是文件时为空
+        std::string content_type;
+        std::vector<std::pair<std::string, std::string>> headers;
+    };
+
+    // 回调返回 false 时停止解析, feed() 返回 false
+    std::function<bool(const Part&)> on_part_begin;
+    std::function<bool(const char* data, size_t size)> on_part_data;
+    std::function<bool()> on_part_end;
+
+    explicit MultipartParser(std::string_view boundary);
+
+    // 格式错误或者回调要求停止时返回 false, 之后不能再调用
+    bool feed(const char* data, size_t size);
+
+    // 已经看到结束的分隔符
+    bool done() const { return state_ == State::epilogue; }
+
+    // 从 Content-Type 中取出 boundary, 不是 multipart/form-data 或者没有 boundary 时返回空
+    static std::string_view boundary(std::string_view content_type);
+
+    // 在 s 中查找 needle (至少 2 个字节): 先用 SSE2 / AVX2 一次比较 16 / 32 个位置的首尾字节, 再逐个确认
+    static size_t find(const char* s, size_t size, std::string_view needle);
+
+private:
+    enum class State { preamble, boundary_line, headers, body, epilogue, error };
+
+    std::string delimiter_;     // "\r\n--" + boundary
+    State state_ = State::preamble;
+    std::string carry_;         // 上一次末尾可能是分隔符开头的部分
+    std::string line_;          // 分隔符所在行或者分段的头部, 还没有读完
+    Part part_;
+
+    // 在分段内容中找分隔符, 返回用掉的字节数
+    size_t body(const char* data, size_t size);
+    bool emit(const char* data, size_t size);
+    bool delimited();
+    void parse_headers(std::string_view block);
+};
+
+// 解析的结果: 普通字段的值放在内存中, 文件直接写入临时文件, 对象析构时删除
+// 处理函数要保留上传的文件时把它 rename 到别处
+class MultipartForm {
+public:
+    struct Options {
+        std::string spool_dir = "/tmp";     // 临时文件的目录
+        size_t max_size = 0;                // 整个请求体的最大长度, 0 表示不限制
+        size_t max_field = 64 * 1024;       // 普通字段的最大长度
+        size_t max_parts = 128;
+    };
+
+    struct Field {
+        std::string name;
+        std::string filename;
+        std::string content_type;
+        std::string value;          // 普通字段的值
+        std::string path;           // 文件落盘的路径
+        size_t size = 0;
+    };
+
+    MultipartForm(std::string_view boundary, const Options& options);
+    ~MultipartForm();
+
+    MultipartForm(const MultipartForm&) = delete;
+    MultipartForm& operator=(const MultipartForm&) = delete;
+
+    // 失败时返回 false, status() 给出应该返回的状态码
+    bool feed(const char* data, size_t size);
+
+    // 请求体读完以后调用, 检查最后一个分隔符
+    bool finish();
+
+    int status() const { return status_; }
+
+    const std::vector<Field>& fields() const { return fields_; }
+
+    const Field* find(std::string_view name) const;
+
+private:
+    const Options& options_;
+    MultipartParser parser_;
+    std::vector<Field> fields_;
+    int fd_ = -1;
+    int status_ = 200;
+
+    bool begin(const MultipartParser::Part& part);
+    bool append(const char* data, size_t size);
+    bool end();
+    void close_file();
+};
+
+#endif	/* MULTIPART_HPP */
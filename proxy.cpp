@@ -0,0 +1,589 @@
+#include "proxy.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+    using steady = std::chrono::steady_clock;
+
+    // 每个 I/O 线程各自持有一组空闲的上游长连接, 取用和归还都不需要加锁
+    struct IdlePool {
+        unordered_map<ReverseProxy::Upstream*, std::vector<int>> idle;
+        ~IdlePool() {
+            for (auto& p : idle)
+                for (int fd : p.second)
+                    ::close(fd);
+        }
+    };
+    thread_local IdlePool idle_pool;
+
+    // 头部的值去掉前后的空白
+    std::string_view trim(std::string_view value) {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+        return value;
+    }
+
+    bool idempotent(http::Method method) {
+        return method == http::Method::get || method == http::Method::head || method == http::Method::options ||
+               method == http::Method::put || method == http::Method::delete_;
+    }
+
+    // 非负的十进制或十六进制数, 整个字符串都必须是数字并且不溢出
+    bool parse_size(std::string_view value, int base, long long& n) {
+        string s(value);
+        if (s.empty() || s[0] == '-' || s[0] == '+')
+            return false;
+        char* end;
+        errno = 0;
+        n = strtoll(s.c_str(), &end, base);
+        return errno == 0 && end == s.c_str() + s.size() && n >= 0;
+    }
+}
+
+// 一次转发: 选择上游、取得连接、发送请求、读取响应头, 然后把响应体边读边交给客户端的连接
+// 所有回调都在 strand_ 上执行, timer_ 超时关闭上游的 socket, 正在进行的操作随之以错误结束
+class ReverseProxy::Forward : public std::enable_shared_from_this<ReverseProxy::Forward> {
+public:
+    Forward(shared_ptr<ReverseProxy> proxy, shared_ptr<ResponseWriter> writer, Response& response, const Request& request)
+        : proxy_(std::move(proxy)), writer_(std::move(writer)), response_(response), request_(request),
+          strand_(make_strand(writer_->get_executor())), socket_(strand_), resolver_(strand_), timer_(strand_), buffer_(65536) {}
+
+    void start() {
+        next_upstream();
+    }
+
+private:
+    // 响应体的结束方式
+    enum class Body { length, chunked, eof };
+
+    shared_ptr<ReverseProxy> proxy_;
+    shared_ptr<ResponseWriter> writer_;
+    Response& response_;
+    const Request& request_;
+
+    strand<any_io_executor> strand_;
+    ip::tcp::socket socket_;
+    ip::tcp::resolver resolver_;
+    steady_timer timer_;
+    streambuf buffer_;          // 上游的响应, 响应头最多 64KB
+    string head_;               // 发给上游的请求行和请求头
+    string content_;            // 请求体不在 streambuf 中时读出来的一份
+
+    std::vector<Upstream*> tried_;
+    Upstream* upstream_ = nullptr;
+    bool reused_ = false;
+    bool retried_ = false;
+    bool responded_ = false;    // 已经收到过上游的响应头 (包括 1xx), 请求一定已经被处理
+    bool keep_alive_ = true;
+    Body body_ = Body::length;
+    long long remaining_ = 0;   // 当前一段 (整个响应体或者一个 chunk) 还没有转发的字节数, 读到关闭为止时为 -1
+
+    // 连不上的上游记一次失败并换下一个上游; 请求已经发出去以后就不再换上游, 避免重复执行非幂等请求
+    void next_upstream() {
+        if (tried_.size() >= proxy_->upstreams_.size())
+            return bad_gateway();
+        upstream_ = proxy_->pick(tried_);
+        tried_.push_back(upstream_);
+        upstream_->outstanding.fetch_add(1, std::memory_order_relaxed);
+
+        int fd = proxy_->acquire(upstream_);
+        if (fd >= 0) {
+            sockaddr_storage address;
+            socklen_t length = sizeof(address);
+            boost::system::error_code ec;
+            if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) == 0)
+                socket_.assign(address.ss_family == AF_INET6 ? ip::tcp::v6() : ip::tcp::v4(), fd, ec);
+            if (!ec && socket_.is_open()) {
+                reused_ = true;
+                return send_request();
+            }
+            ::close(fd);
+        }
+        connect();
+    }
+
+    void connect() {
+        reused_ = false;
+        auto self = shared_from_this();
+        arm();
+        resolver_.async_resolve(upstream_->host, upstream_->port, bind_executor(strand_,
+            [self](const boost::system::error_code& ec, ip::tcp::resolver::results_type results) {
+                if (ec)
+                    return self->connect_failed();
+                async_connect(self->socket_, results, bind_executor(self->strand_,
+                    [self](const boost::system::error_code& ec, const ip::tcp::endpoint&) {
+                        self->timer_.cancel();
+                        if (ec)
+                            return self->connect_failed();
+                        boost::system::error_code ignored;
+                        self->socket_.set_option(ip::tcp::no_delay(true), ignored);
+                        self->send_request();
+                    }));
+            }));
+    }
+
+    void connect_failed() {
+        close();
+        leave(false);
+        next_upstream();
+    }
+
+    void send_request() {
+        if (head_.empty()) {
+            // 请求行和请求头
+            head_.reserve(512);
+            head_ += request_.method;
+            head_ += ' ';
+            head_ += request_.target;
+            head_ += " HTTP/1.1\r\n";
+            for (auto& h : request_.header) {
+                // 逐跳(hop-by-hop)头部不转发; 请求体已经完整读到, 不需要上游再回 100 Continue
+                http::Field field = http::field(h.first);
+                if (http::is_hop_by_hop(field) || field == http::Field::expect)
+                    continue;
+                head_ += h.first;
+                head_ += ": ";
+                head_ += h.second;
+                head_ += "\r\n";
+            }
+            head_ += "\r\n";
+        }
+
+        // 请求体已经在连接的 streambuf 中, 直接从中发送, 不消耗也不拷贝, 失败时可以重试
+        std::vector<const_buffer> buffers{buffer(head_)};
+        if (request_.content_length > 0 && request_.content) {
+            size_t remaining = request_.content_length;
+            if (auto sb = dynamic_cast<boost::asio::streambuf*>(request_.content->rdbuf())) {
+                for (auto& b : sb->data()) {
+                    size_t n = std::min(remaining, b.size());
+                    buffers.push_back(buffer(b.data(), n));
+                    remaining -= n;
+                    if (remaining == 0)
+                        break;
+                }
+            }
+            else {
+                if (content_.empty()) {
+                    content_.resize(remaining);
+                    request_.content->read(&content_[0], remaining);
+                    content_.resize(request_.content->gcount());
+                }
+                buffers.push_back(buffer(content_));
+            }
+        }
+
+        auto self = shared_from_this();
+        arm();
+        async_write(socket_, buffers, bind_executor(strand_, [self](const boost::system::error_code& ec, size_t) {
+            if (ec)
+                return self->request_failed();
+            self->read_head();
+        }));
+    }
+
+    // 还没有收到响应时出错: 复用的长连接可能已经被上游关闭, 此时换一条新连接重试一次
+    // 只重试幂等的方法: 上游可能已经执行了请求, 只是在回复之前连接断了, POST 等再发一次就执行了两次
+    void request_failed() {
+        close();
+        if (reused_ && !retried_ && !responded_ && buffer_.size() == 0 && idempotent(request_.method_id)) {
+            retried_ = true;
+            return connect();
+        }
+        leave(false);
+        bad_gateway();
+    }
+
+    void read_head() {
+        auto self = shared_from_this();
+        async_read_until(socket_, buffer_, "\r\n\r\n", bind_executor(strand_, [self](const boost::system::error_code& ec, size_t size) {
+            self->timer_.cancel();
+            if (ec)
+                return self->request_failed();
+            self->parse_head(size);
+        }));
+    }
+
+    void parse_head(size_t size) {
+        std::string_view head(static_cast<const char*>(buffer_.data().data()), size);
+        auto eol = head.find("\r\n");
+        std::string_view status_line = head.substr(0, eol);
+        auto sp = status_line.find(' ');
+        long long status = 0;
+        if (status_line.compare(0, 5, "HTTP/") != 0 || sp == std::string_view::npos ||
+            !parse_size(status_line.substr(sp + 1, 3), 10, status) || status < 100 || status > 999)
+            return bad_upstream();
+        responded_ = true;
+        // 中间响应 (100 Continue、103 Early Hints) 不是最终的响应, 丢掉后继续读; 101 不会出现, Upgrade 没有转发
+        if (status < 200 && status != 101) {
+            buffer_.consume(size);
+            arm();
+            return read_head();
+        }
+        keep_alive_ = status_line.compare(0, 8, "HTTP/1.0") != 0;
+
+        // 响应头; 长度相关的头部以及 Date、Server 由 Response 重新生成
+        long long content_length = -1;
+        bool chunked = false;
+        for (size_t begin = eol + 2; begin < size; ) {
+            auto end = head.find("\r\n", begin);
+            std::string_view line = head.substr(begin, end - begin);
+            begin = end + 2;
+            if (line.empty())
+                break;
+            auto colon = line.find(':');
+            if (colon == std::string_view::npos)
+                continue;
+            std::string_view name = line.substr(0, colon);
+            std::string_view value = trim(line.substr(colon + 1));
+
+            switch (http::field(name)) {
+                case http::Field::content_length:
+                    // 不合法或者前后不一致的长度无法确定响应在哪里结束 (RFC 7230 3.3.3)
+                    long long n;
+                    if (!parse_size(value, 10, n) || (content_length >= 0 && n != content_length))
+                        return bad_upstream();
+                    content_length = n;
+                    break;
+                case http::Field::transfer_encoding:
+                    chunked = strcasestr(string(value).c_str(), "chunked") != nullptr;
+                    break;
+                case http::Field::connection: {
+                    string v(value);
+                    keep_alive_ = strcasestr(v.c_str(), "close") == nullptr &&
+                                  (keep_alive_ || strcasestr(v.c_str(), "keep-alive") != nullptr);
+                    break;
+                }
+                case http::Field::keep_alive:
+                case http::Field::proxy_connection:
+                case http::Field::te:
+                case http::Field::trailer:
+                case http::Field::upgrade:
+                case http::Field::date:
+                case http::Field::server:
+                    break;
+                default:
+                    response_.header(name, value);
+                    break;
+            }
+        }
+        buffer_.consume(size);
+        response_.status(static_cast<int>(status));
+
+        // HEAD 和 304 没有响应体, 但 Content-Length 是完整响应的长度, 原样转发
+        bool head_request = request_.method_id == http::Method::head;
+        if (head_request || status < 200 || status == 204 || status == 304) {
+            if (content_length >= 0 && (head_request || status == 304))
+                response_.content_length(content_length);
+            finish_upstream(keep_alive_ && buffer_.size() == 0 && status >= 200);
+            writer_->finish();
+            return;
+        }
+
+        // 分块编码去掉以后再按客户端的版本重新编码, 长度由上游决定的响应原样给出长度
+        if (chunked) {
+            body_ = Body::chunked;
+            response_.content_length(-1);
+        }
+        else if (content_length >= 0) {
+            body_ = Body::length;
+            remaining_ = content_length;
+            // 整个响应体已经和响应头一起读到时, 作为普通的响应和头部一起发送
+            if (buffer_.size() >= static_cast<size_t>(content_length)) {
+                response_.write(static_cast<const char*>(buffer_.data().data()), content_length);
+                buffer_.consume(content_length);
+                finish_upstream(keep_alive_ && buffer_.size() == 0);
+                writer_->finish();
+                return;
+            }
+            response_.content_length(content_length);
+        }
+        else {
+            // 上游用关闭连接来表示响应结束
+            body_ = Body::eof;
+            remaining_ = -1;
+            keep_alive_ = false;
+            response_.content_length(-1);
+        }
+
+        auto self = shared_from_this();
+        writer_->write_head([self](const boost::system::error_code& ec) {
+            post(self->strand_, [self, ec]() {
+                if (ec)
+                    return self->client_failed();
+                if (self->body_ == Body::chunked)
+                    self->read_chunk_size();
+                else
+                    self->relay();
+            });
+        });
+    }
+
+    // 转发当前一段中的 remaining_ 个字节, 先发已经读到的, 客户端收下以后再从上游读
+    void relay() {
+        if (remaining_ == 0)
+            return segment_done();
+
+        auto self = shared_from_this();
+        if (buffer_.size() > 0) {
+            size_t n = buffer_.size();
+            if (remaining_ > 0)
+                n = std::min<size_t>(n, remaining_);
+            writer_->write_body(buffer(buffer_.data().data(), n), [self, n](const boost::system::error_code& ec) {
+                post(self->strand_, [self, ec, n]() {
+                    if (ec)
+                        return self->client_failed();
+                    self->buffer_.consume(n);
+                    if (self->remaining_ > 0)
+                        self->remaining_ -= n;
+                    self->relay();
+                });
+            });
+            return;
+        }
+
+        arm();
+        socket_.async_read_some(buffer_.prepare(16384), bind_executor(strand_, [self](const boost::system::error_code& ec, size_t n) {
+            self->timer_.cancel();
+            if (ec == error::eof && self->body_ == Body::eof)
+                return self->done(false);
+            if (ec)
+                return self->upstream_failed();
+            self->buffer_.commit(n);
+            self->relay();
+        }));
+    }
+
+    void segment_done() {
+        if (body_ == Body::chunked)
+            read_line([](Forward* self, std::string_view line) {
+                // chunk 数据后面的 CRLF
+                if (!line.empty())
+                    return self->upstream_failed();
+                self->read_chunk_size();
+            });
+        else
+            done(keep_alive_ && buffer_.size() == 0);
+    }
+
+    void read_chunk_size() {
+        read_line([](Forward* self, std::string_view line) {
+            long long size;
+            // 忽略 chunk 扩展
+            if (!parse_size(trim(line.substr(0, line.find(';'))), 16, size))
+                return self->upstream_failed();
+            if (size == 0)
+                return self->read_trailer();
+            self->remaining_ = size;
+            self->relay();
+        });
+    }
+
+    // trailer 不转发, 读到最后的空行为止
+    void read_trailer() {
+        read_line([](Forward* self, std::string_view line) {
+            if (line.empty())
+                return self->done(self->keep_alive_ && self->buffer_.size() == 0);
+            self->read_trailer();
+        });
+    }
+
+    // 读取一行 (不含 CRLF) 交给 f, 一行最长 64KB
+    template <class F>
+    void read_line(F f) {
+        auto self = shared_from_this();
+        arm();
+        async_read_until(socket_, buffer_, "\r\n", bind_executor(strand_, [self, f](const boost::system::error_code& ec, size_t size) {
+            self->timer_.cancel();
+            if (ec)
+                return self->upstream_failed();
+            string line(static_cast<const char*>(self->buffer_.data().data()), size - 2);
+            self->buffer_.consume(size);
+            f(self.get(), line);
+        }));
+    }
+
+    // 响应完整地转发了
+    void done(bool reusable) {
+        finish_upstream(reusable);
+        writer_->end(true);
+    }
+
+    // 上游的响应不完整或者不合法, 已经发出的响应头不能收回, 只能中断客户端的连接
+    void upstream_failed() {
+        close();
+        leave(false);
+        writer_->end(false);
+    }
+
+    void client_failed() {
+        close();
+        leave(true);
+        writer_->end(false);
+    }
+
+    // 还没有向客户端发送任何内容时发现上游的响应不合法
+    void bad_upstream() {
+        close();
+        leave(false);
+        bad_gateway();
+    }
+
+    void bad_gateway() {
+        // 上游中途出错时已经收到的部分响应也不能发出去
+        response_.reset();
+        response_.status(502) << "Bad Gateway";
+        writer_->finish();
+    }
+
+    void finish_upstream(bool reusable) {
+        timer_.cancel();
+        boost::system::error_code ec;
+        int fd = reusable ? socket_.release(ec) : -1;
+        if (fd >= 0 && !ec)
+            proxy_->release(upstream_, fd);
+        else
+            close();
+        leave(true);
+    }
+
+    // 结束对当前上游的这次请求
+    void leave(bool ok) {
+        if (!upstream_)
+            return;
+        upstream_->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        if (ok)
+            proxy_->mark_success(upstream_);
+        else
+            proxy_->mark_failure(upstream_);
+        upstream_ = nullptr;
+    }
+
+    void close() {
+        boost::system::error_code ignored;
+        timer_.cancel();
+        resolver_.cancel();
+        socket_.close(ignored);
+        buffer_.consume(buffer_.size());
+    }
+
+    // 与上游之间的每次读写最多 io_timeout_ 秒
+    void arm() {
+        auto self = shared_from_this();
+        timer_.expires_after(std::chrono::seconds(proxy_->io_timeout_));
+        timer_.async_wait(bind_executor(strand_, [self](const boost::system::error_code& ec) {
+            if (ec)
+                return;
+            boost::system::error_code ignored;
+            self->resolver_.cancel();
+            self->socket_.close(ignored);
+        }));
+    }
+};
+
+ReverseProxy::ReverseProxy(const std::vector<string>& upstreams, size_t max_idle, size_t max_fails,
+                           size_t fail_timeout, size_t io_timeout)
+    : max_idle_(max_idle), max_fails_(max_fails), fail_timeout_(fail_timeout), io_timeout_(io_timeout) {
+
+    for (auto& u : upstreams) {
+        auto upstream = std::make_unique<Upstream>();
+        auto colon = u.rfind(':');
+        if (colon == string::npos) {
+            upstream->host = u;
+            upstream->port = "80";
+        }
+        else {
+            upstream->host = u.substr(0, colon);
+            upstream->port = u.substr(colon + 1);
+        }
+        // 支持 [::1]:8080 形式的 IPv6 地址
+        if (upstream->host.size() > 2 && upstream->host.front() == '[' && upstream->host.back() == ']')
+            upstream->host = upstream->host.substr(1, upstream->host.size() - 2);
+        upstreams_.push_back(std::move(upstream));
+    }
+    if (upstreams_.empty())
+        throw std::invalid_argument("reverse proxy needs at least one upstream");
+}
+
+function<void(Response&, const Request&, const smatch&, std::pmr::memory_resource&)> ReverseProxy::handler() {
+    auto self = shared_from_this();
+    return [self](Response& response, const Request& request, const smatch& path_match, std::pmr::memory_resource& arena) {
+        self->forward(response, request);
+    };
+}
+
+ReverseProxy::Upstream* ReverseProxy::pick(const std::vector<Upstream*>& tried) {
+    // 从轮转位置开始, 选出可用上游中未完成请求最少的一个
+    // 全部不可用时, 选择最早恢复的那个（总比直接返回 502 好）
+    auto now = steady::now().time_since_epoch().count();
+    size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+    Upstream* best = nullptr;
+    Upstream* earliest = nullptr;
+    for (size_t i = 0; i < upstreams_.size(); i++) {
+        Upstream* u = upstreams_[(start + i) % upstreams_.size()].get();
+        if (std::find(tried.begin(), tried.end(), u) != tried.end())
+            continue;
+        auto down_until = u->down_until.load(std::memory_order_relaxed);
+        if (down_until > now) {
+            if (!earliest || down_until < earliest->down_until.load(std::memory_order_relaxed))
+                earliest = u;
+            continue;
+        }
+        if (!best || u->outstanding.load(std::memory_order_relaxed) < best->outstanding.load(std::memory_order_relaxed))
+            best = u;
+    }
+    return best ? best : earliest;
+}
+
+void ReverseProxy::mark_success(Upstream* upstream) {
+    upstream->failures.store(0, std::memory_order_relaxed);
+    upstream->down_until.store(0, std::memory_order_relaxed);
+}
+
+void ReverseProxy::mark_failure(Upstream* upstream) {
+    if (upstream->failures.fetch_add(1, std::memory_order_relaxed) + 1 >= max_fails_) {
+        auto until = steady::now() + std::chrono::seconds(fail_timeout_);
+        upstream->down_until.store(until.time_since_epoch().count(), std::memory_order_relaxed);
+        upstream->failures.store(0, std::memory_order_relaxed);
+    }
+}
+
+int ReverseProxy::acquire(Upstream* upstream) {
+    auto& idle = idle_pool.idle[upstream];
+    while (!idle.empty()) {
+        int fd = idle.back();
+        idle.pop_back();
+        // 空闲连接上可读说明上游已经关闭（或者发来了多余的数据）, 丢弃
+        pollfd p{fd, POLLIN, 0};
+        if (::poll(&p, 1, 0) == 0)
+            return fd;
+        ::close(fd);
+    }
+    return -1;
+}
+
+void ReverseProxy::release(Upstream* upstream, int fd) {
+    auto& idle = idle_pool.idle[upstream];
+    if (idle.size() < max_idle_)
+        idle.push_back(fd);
+    else
+        ::close(fd);
+}
+
+void ReverseProxy::forward(Response& response, const Request& request) {
+    auto writer = response.defer();
+    if (!writer) {
+        response.status(500) << "reverse proxy needs an asynchronous caller";
+        return;
+    }
+    std::make_shared<Forward>(shared_from_this(), std::move(writer), response, request)->start();
+}
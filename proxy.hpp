@@ -0,0 +1,58 @@
+#ifndef PROXY_HPP
+#define	PROXY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "httpserver.hpp"
+
+
+// 反向代理：把匹配到的请求转发给一组上游 HTTP 服务器
+// 用法：
+//   auto proxy = std::make_shared<ReverseProxy>(std::vector<string>{"127.0.0.1:9000", "127.0.0.1:9001"});
+//   server.resources_["^/api/.*"]["GET"] = proxy->handler();
+class ReverseProxy : public std::enable_shared_from_this<ReverseProxy> {
+public:
+    struct Upstream {
+        string host;
+        string port;
+        std::atomic<size_t> outstanding{0};                    // 正在处理中的请求数（最少未完成请求负载均衡）
+        std::atomic<size_t> failures{0};                       // 连续失败次数（被动健康检查）
+        std::atomic<std::chrono::steady_clock::rep> down_until{0};
+    };
+
+    ReverseProxy(const std::vector<string>& upstreams, size_t max_idle = 16, size_t max_fails = 3,
+                 size_t fail_timeout = 10, size_t io_timeout = 30);
+
+    // 返回可以直接注册到 resources_ 中的处理函数
+    function<void(Response&, const Request&, const smatch&, std::pmr::memory_resource&)> handler();
+
+    // 调用 response.defer() 后立即返回, 与上游之间的读写都是连接所在 executor 上的异步操作, 不占用 I/O 线程;
+    // 响应体边从上游读取边发给客户端
+    void forward(Response& response, const Request& request);
+
+private:
+    std::vector<std::unique_ptr<Upstream>> upstreams_;
+    std::atomic<size_t> next_{0};
+
+    size_t max_idle_;       // 每个 I/O 线程、每个上游保留的空闲长连接数
+    size_t max_fails_;
+    size_t fail_timeout_;   // 秒, 上游被标记为不可用的时间
+    size_t io_timeout_;     // 秒, 与上游之间每次读写的超时
+
+    // 一次转发的状态和异步操作
+    class Forward;
+
+    Upstream* pick(const std::vector<Upstream*>& tried);
+    void mark_success(Upstream* upstream);
+    void mark_failure(Upstream* upstream);
+
+    // 取出一条空闲的长连接, 没有时返回 -1
+    int acquire(Upstream* upstream);
+    void release(Upstream* upstream, int fd);
+};
+
+#endif	/* PROXY_HPP */
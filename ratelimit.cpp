@@ -0,0 +1,104 @@
+#include "ratelimit.hpp"
+
+#include <algorithm>
+
+namespace {
+    // 64 位混合函数 (splitmix64 的最后一步), 让相邻的地址分散到不同的分片和槽位
+    uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    // 桶的容量至少是 1 个令牌并且不小于每秒的速率, 否则 rate 小于 1 时每个请求都会被拒绝
+    RateLimiter::Limit clamp(RateLimiter::Limit limit) {
+        limit.burst = std::max({1.0, limit.rate, limit.burst});
+        return limit;
+    }
+}
+
+RateLimiter::RateLimiter(Limit per_ip, size_t capacity, size_t num_shards)
+    : per_ip_(clamp(per_ip)), shards_(num_shards > 0 ? num_shards : 1), epoch_(std::chrono::steady_clock::now()) {
+
+    size_t per_shard = std::max(probe_window_, capacity / shards_.size());
+    for (auto& shard : shards_)
+        shard.buckets.resize(per_shard);
+}
+
+void RateLimiter::add_route(const std::string& pattern, Limit limit) {
+    routes_.push_back(Route{std::regex(pattern), clamp(limit)});
+}
+
+uint64_t RateLimiter::make_key(const boost::asio::ip::address& address, size_t route) const {
+    uint64_t h = route * 0x9e3779b97f4a7c15ULL;
+    if (address.is_v4()) {
+        h ^= mix(address.to_v4().to_uint() + 1);
+    }
+    else {
+        auto bytes = address.to_v6().to_bytes();
+        uint64_t hi = 0, lo = 0;
+        for (size_t i = 0; i < 8; i++) {
+            hi = (hi << 8) | bytes[i];
+            lo = (lo << 8) | bytes[i + 8];
+        }
+        h ^= mix(hi) ^ mix(lo + 0x632be59bd9b4e019ULL);
+    }
+    h = mix(h);
+    return h == 0 ? 1 : h;
+}
+
+bool RateLimiter::allow(const boost::asio::ip::address& address) {
+    if (per_ip_.rate <= 0)
+        return true;
+    return take(make_key(address, 0), per_ip_);
+}
+
+bool RateLimiter::allow(const boost::asio::ip::address& address, std::string_view path) {
+    for (size_t i = 0; i < routes_.size(); i++) {
+        if (std::regex_match(path.begin(), path.end(), routes_[i].pattern))
+            return take(make_key(address, i + 1), routes_[i].limit);
+    }
+    return true;
+}
+
+bool RateLimiter::take(uint64_t key, const Limit& limit) {
+    uint32_t now = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - epoch_).count());
+
+    Shard& shard = shards_[key % shards_.size()];
+    size_t n = shard.buckets.size();
+    size_t start = (key >> 32) % n;
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    // 在探测窗口内查找; 找不到时用空位, 没有空位就淘汰最久没访问的桶
+    Bucket* victim = nullptr;
+    for (size_t i = 0; i < probe_window_; i++) {
+        Bucket& b = shard.buckets[(start + i) % n];
+        if (b.key == key) {
+            // 按流逝的时间补充令牌, uint32_t 相减在回绕时仍然正确
+            float elapsed = static_cast<float>(now - b.last) / 1000.0f;
+            b.tokens = std::min(static_cast<float>(limit.burst), b.tokens + elapsed * static_cast<float>(limit.rate));
+            b.last = now;
+            if (b.tokens < 1.0f)
+                return false;
+            b.tokens -= 1.0f;
+            return true;
+        }
+        if (b.key == 0) {
+            if (!victim || victim->key != 0)
+                victim = &b;
+        }
+        else if (!victim || (victim->key != 0 && now - b.last > now - victim->last)) {
+            victim = &b;
+        }
+    }
+
+    victim->key = key;
+    victim->tokens = static_cast<float>(limit.burst) - 1.0f;
+    victim->last = now;
+    return victim->tokens >= 0.0f;
+}
@@ -0,0 +1,68 @@
+#ifndef RATELIMIT_HPP
+#define	RATELIMIT_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+
+// 按客户端 IP (以及 IP + 路径) 限流的令牌桶
+// 令牌桶放在分片的开放寻址表中, 每个桶 16 字节, 一个缓存行放 4 个;
+// 令牌在访问时才按流逝的时间补充, 表满时在探测窗口内淘汰最久没有访问的桶, 内存占用固定
+class RateLimiter {
+public:
+    struct Limit {
+        double rate = 0;    // 每秒补充的令牌数, 0 表示不限制
+        double burst = 0;   // 桶的容量, 至少为 1 和 rate
+    };
+
+    RateLimiter(Limit per_ip, size_t capacity = 65536, size_t num_shards = 16);
+
+    void add_route(const std::string& pattern, Limit limit);
+
+    // 每个 IP 的总体限制, 在解析请求之前检查
+    bool allow(const boost::asio::ip::address& address);
+
+    // 每个 IP 在某一类路径上的限制, 在读取请求体之前检查
+    bool allow(const boost::asio::ip::address& address, std::string_view path);
+
+    bool has_routes() const { return !routes_.empty(); }
+
+    // 调整以后实际使用的每个 IP 的限制
+    const Limit& per_ip() const { return per_ip_; }
+
+private:
+    struct Bucket {
+        uint64_t key = 0;       // 0 表示空位
+        float tokens = 0;
+        uint32_t last = 0;      // 上次访问的时间, 毫秒
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::vector<Bucket> buckets;
+    };
+
+    struct Route {
+        std::regex pattern;
+        Limit limit;
+    };
+
+    static constexpr size_t probe_window_ = 8;
+
+    Limit per_ip_;
+    std::vector<Route> routes_;
+    std::vector<Shard> shards_;
+    std::chrono::steady_clock::time_point epoch_;
+
+    bool take(uint64_t key, const Limit& limit);
+    uint64_t make_key(const boost::asio::ip::address& address, size_t route) const;
+};
+
+#endif	/* RATELIMIT_HPP */
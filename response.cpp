@@ -0,0 +1,193 @@
+#include "response.hpp"
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <limits>
+
+namespace {
+    const std::string server_header = "Server: httpserver\r\n";
+    const std::string header_separator = ": ";
+    const std::string crlf = "\r\n";
+
+    // 每个线程缓存一份 Date 头, 一秒钟最多格式化一次
+    struct DateCache {
+        time_t second = 0;
+        char line[64];
+        size_t size = 0;
+
+        void refresh() {
+            time_t now = time(nullptr);
+            if (now == second)
+                return;
+            second = now;
+            struct tm tm;
+            gmtime_r(&now, &tm);
+            size = strftime(line, sizeof(line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        }
+    };
+    thread_local DateCache date_cache;
+
+    const char* reason_phrase(int code) {
+        switch (code) {
+            case 100: return "Continue";
+            case 101: return "Switching Protocols";
+            case 200: return "OK";
+            case 201: return "Created";
+            case 202: return "Accepted";
+            case 204: return "No Content";
+            case 206: return "Partial Content";
+            case 301: return "Moved Permanently";
+            case 302: return "Found";
+            case 303: return "See Other";
+            case 304: return "Not Modified";
+            case 307: return "Temporary Redirect";
+            case 308: return "Permanent Redirect";
+            case 400: return "Bad Request";
+            case 401: return "Unauthorized";
+            case 403: return "Forbidden";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 408: return "Request Timeout";
+            case 411: return "Length Required";
+            case 413: return "Payload Too Large";
+            case 414: return "URI Too Long";
+            case 415: return "Unsupported Media Type";
+            case 416: return "Range Not Satisfiable";
+            case 426: return "Upgrade Required";
+            case 429: return "Too Many Requests";
+            case 500: return "Internal Server Error";
+            case 501: return "Not Implemented";
+            case 502: return "Bad Gateway";
+            case 503: return "Service Unavailable";
+            case 504: return "Gateway Timeout";
+            default:  return "Unknown";
+        }
+    }
+}
+
+const std::string& Response::status_line(int code) {
+    static const std::array<std::string, 600> lines = []() {
+        std::array<std::string, 600> lines;
+        for (int c = 100; c < 600; c++)
+            lines[c] = "HTTP/1.1 " + std::to_string(c) + " " + reason_phrase(c) + "\r\n";
+        return lines;
+    }();
+    if (code < 100 || code >= 600)
+        return lines[500];
+    return lines[code];
+}
+
+Response::Response(std::pmr::memory_resource* resource)
+    : std::ostream(nullptr), body_((std::numeric_limits<std::size_t>::max)(), resource),
+    headers_(resource), head_(resource), buffers_(resource) {
+    rdbuf(&body_);
+}
+
+Response& Response::status(int code) {
+    status_ = code;
+    return *this;
+}
+
+Response& Response::header(std::string_view name, std::string_view value) {
+    headers_.emplace_back(name, value);
+    return *this;
+}
+
+Response& Response::header_block(std::string_view lines) {
+    header_block_ = lines;
+    return *this;
+}
+
+Response& Response::body(std::shared_ptr<const void> owner, boost::asio::const_buffer data) {
+    external_owner_ = std::move(owner);
+    external_ = data;
+    return *this;
+}
+
+Response& Response::body(std::shared_ptr<const std::string> data) {
+    boost::asio::const_buffer buffer(data->data(), data->size());
+    return body(std::move(data), buffer);
+}
+
+Response& Response::content_length(long long n) {
+    has_content_length_ = true;
+    content_length_ = n;
+    return *this;
+}
+
+std::shared_ptr<ResponseWriter> Response::defer() {
+    if (!deferrer_)
+        return nullptr;
+    deferred_ = true;
+    auto deferrer = std::move(deferrer_);
+    deferrer_ = nullptr;
+    return deferrer();
+}
+
+void Response::reset() {
+    status_ = 200;
+    has_content_length_ = false;
+    content_length_ = -1;
+    headers_.clear();
+    header_block_ = std::string_view();
+    body_.consume(body_.size());
+    external_owner_.reset();
+    external_ = boost::asio::const_buffer();
+    std::ostream::clear();
+}
+
+size_t Response::body_size() const {
+    return body_.size() + external_.size();
+}
+
+std::string Response::body_string() const {
+    std::string s;
+    s.reserve(body_size());
+    for (auto& b : body_.data())
+        s.append(static_cast<const char*>(b.data()), b.size());
+    s.append(static_cast<const char*>(external_.data()), external_.size());
+    return s;
+}
+
+const std::pmr::vector<boost::asio::const_buffer>& Response::to_buffers(bool include_body) {
+    date_cache.refresh();
+
+    // 头部拼成一段: 每个头拆成 名字 / ": " / 值 / "\r\n" 四个 buffer 时, 小响应的 writev 要逐段拷贝,
+    // 开销比拼接本身大得多
+    // 先算出长度, 在内存池中只分配一次
+    size_t size = status_line(status_).size() + date_cache.size + server_header.size() + header_block_.size() + 48;
+    for (auto& h : headers_)
+        size += h.first.size() + h.second.size() + 4;
+    head_.clear();
+    head_.reserve(size);
+    head_.append(status_line(status_));
+    head_.append(date_cache.line, date_cache.size);
+    head_.append(server_header);
+    for (auto& h : headers_)
+        head_.append(h.first).append(header_separator).append(h.second).append(crlf);
+    head_.append(header_block_);
+
+    // 1xx 和 204 不能带 Content-Length (RFC 7230 3.3.2), 比如 WebSocket 握手的 101;
+    // 304 没有响应体, 只有指定了长度 (转发上游的 304) 时才发送; 长度未知时也不发送
+    long long length = content_length();
+    if (status_ < 200 || status_ == 204 || (status_ == 304 && !has_content_length_) || length < 0) {
+        head_.append(crlf);
+    }
+    else {
+        char content_length[48];
+        int n = snprintf(content_length, sizeof(content_length), "Content-Length: %lld\r\n\r\n", length);
+        head_.append(content_length, n);
+    }
+
+    buffers_.clear();
+    buffers_.emplace_back(head_.data(), head_.size());
+    if (include_body) {
+        for (auto& b : body_.data())
+            buffers_.emplace_back(b);
+        if (external_.size() > 0)
+            buffers_.push_back(external_);
+    }
+    return buffers_;
+}
@@ -0,0 +1,112 @@
+#ifndef RESPONSE_HPP
+#define	RESPONSE_HPP
+
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+
+// 异步完成的响应, 由 Response::defer() 取得, 可以在处理函数返回以后、在其他回调中使用
+// 两种用法: 把完整的响应写在 Response 中以后调用 finish(); 或者流式发送: write_head() 发送状态行和头部,
+// 多次 write_body() 发送响应体 (上一次的 handler 调用以后才能写下一块), 最后 end()
+// handler 不在调用者的栈上执行, 可能在任何一个运行 io_context 的线程上
+class ResponseWriter {
+public:
+    typedef std::function<void(const boost::system::error_code&)> Handler;
+
+    virtual ~ResponseWriter() = default;
+
+    virtual void finish() = 0;
+
+    // 响应体的长度在这之前用 Response::content_length() 指定, -1 表示未知 (chunked, HTTP/1.0 的客户端发送完关闭连接)
+    virtual void write_head(Handler handler) = 0;
+
+    // data 指向的数据在 handler 调用之前必须保持有效
+    virtual void write_body(boost::asio::const_buffer data, Handler handler) = 0;
+
+    // ok 为 false 表示响应没有完整发出 (比如上游中途断开), 之后关闭连接
+    virtual void end(bool ok) = 0;
+
+    // 连接所在的 executor, 异步操作的对象可以在它上面创建
+    virtual boost::asio::any_io_executor get_executor() = 0;
+};
+
+// 处理函数填写的响应
+// 本身就是一个 ostream, 处理函数用 << 写入的是响应体; 状态行、Date、Server、Content-Length 和其他头部
+// 在发送时拼成一段连续的头部, 和响应体组成 const_buffer 列表交给 async_write 一次性 (writev) 发送, 不再经过 iostream 格式化
+// 头部、响应体和 const_buffer 列表都从构造时给出的 memory_resource 分配, 服务器传入的是连接的内存池
+class Response : public std::ostream {
+public:
+    typedef std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>> Headers;
+
+    explicit Response(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+    Response(const Response&) = delete;
+    Response& operator=(const Response&) = delete;
+
+    Response& status(int code);
+    int status() const { return status_; }
+
+    Response& header(std::string_view name, std::string_view value);
+    const Headers& headers() const { return headers_; }
+
+    // 预先格式化好的一段头部 ("Name: value\r\n" 若干行), 发送时整段拷贝进头部, 不用逐个格式化;
+    // 在 to_buffers() 之前必须保持有效, 比如 mmap 的 AssetBundle 中的数据
+    Response& header_block(std::string_view lines);
+    std::string_view header_block() const { return header_block_; }
+
+    // 直接引用一段外部的、不可变的数据作为响应体, 不拷贝; owner 保证发送完成之前数据不会被释放
+    Response& body(std::shared_ptr<const void> owner, boost::asio::const_buffer data);
+    Response& body(std::shared_ptr<const std::string> data);
+
+    size_t body_size() const;
+
+    // 头部中的 Content-Length 用 n 而不是响应体的长度, 比如 HEAD 请求的响应、转发上游的 304, 或者流式发送的响应;
+    // n 为 -1 表示长度未知
+    Response& content_length(long long n);
+    long long content_length() const { return has_content_length_ ? content_length_ : static_cast<long long>(body_size()); }
+
+    // 处理函数在返回时还不能完成响应 (比如要等待上游) 时调用, 之后通过返回的 writer 完成响应,
+    // 处理函数返回时调用者不再发送响应; 调用者不支持异步完成时返回空指针
+    std::shared_ptr<ResponseWriter> defer();
+    bool deferred() const { return deferred_; }
+
+    // 由调用处理函数的一方 (服务器、微缓存) 设置, defer() 时调用一次
+    void on_defer(std::function<std::shared_ptr<ResponseWriter>()> deferrer) { deferrer_ = std::move(deferrer); }
+
+    // 丢弃已经写入的状态、头部和响应体, 重新开始
+    void reset();
+
+    // 响应体的内容 (拷贝一份), 用于缓存等场景
+    std::string body_string() const;
+
+    // 组装好的状态行、头部和响应体, 在 async_write 完成之前 Response 对象必须保持有效
+    const std::pmr::vector<boost::asio::const_buffer>& to_buffers(bool include_body = true);
+
+    // 预先生成的状态行, 比如 "HTTP/1.1 404 Not Found\r\n"
+    static const std::string& status_line(int code);
+
+private:
+    boost::asio::basic_streambuf<std::pmr::polymorphic_allocator<char>> body_;
+    std::shared_ptr<const void> external_owner_;
+    boost::asio::const_buffer external_;
+
+    int status_ = 200;
+    bool has_content_length_ = false;
+    long long content_length_ = -1;
+    bool deferred_ = false;
+    std::function<std::shared_ptr<ResponseWriter>()> deferrer_;
+    Headers headers_;
+    std::string_view header_block_;
+    std::pmr::string head_;
+    std::pmr::vector<boost::asio::const_buffer> buffers_;
+};
+
+#endif	/* RESPONSE_HPP */
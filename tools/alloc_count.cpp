@@ -0,0 +1,101 @@
+// 统计进程中 malloc / calloc / realloc / aligned_alloc / posix_memalign / memalign 的调用次数和 free 的次数,
+// 用 LD_PRELOAD 加载, 测量每个请求经过全局分配器的次数 (operator new 也经过 malloc)
+// g++ -std=c++17 -O2 -shared -fPIC tools/alloc_count.cpp -o alloc_count.so
+// LD_PRELOAD=./alloc_count.so ./http
+// kill -USR2 <pid>   向 stderr 输出到目前为止的次数; 在同一个连接上发送 N 个请求的前后各输出一次, 差值除以 N
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+
+#include <unistd.h>
+
+// glibc 内部的实现, 直接调用它们, 不需要 dlsym (dlsym 本身会调用 calloc)
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* p, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void* p);
+}
+
+namespace {
+    std::atomic<long> allocs{0};
+    std::atomic<long> frees{0};
+
+    // 信号处理函数中不能调用 printf (它可能分配内存), 自己格式化
+    char* append(char* out, const char* s) {
+        while (*s)
+            *out++ = *s++;
+        return out;
+    }
+
+    char* append(char* out, long n) {
+        char digits[24];
+        int i = 0;
+        do {
+            digits[i++] = static_cast<char>('0' + n % 10);
+            n /= 10;
+        } while (n > 0);
+        while (i > 0)
+            *out++ = digits[--i];
+        return out;
+    }
+
+    void report(int) {
+        char line[96];
+        char* p = append(line, "allocs ");
+        p = append(p, allocs.load(std::memory_order_relaxed));
+        p = append(p, " frees ");
+        p = append(p, frees.load(std::memory_order_relaxed));
+        p = append(p, "\n");
+        ssize_t ignored = ::write(STDERR_FILENO, line, p - line);
+        (void)ignored;
+    }
+
+    __attribute__((constructor)) void install() {
+        std::signal(SIGUSR2, report);
+    }
+
+    __attribute__((destructor)) void finish() {
+        report(0);
+    }
+
+    void* counted(void* p) {
+        allocs.fetch_add(1, std::memory_order_relaxed);
+        return p;
+    }
+}
+
+extern "C" {
+    void* malloc(size_t size) {
+        return counted(__libc_malloc(size));
+    }
+
+    void* calloc(size_t count, size_t size) {
+        return counted(__libc_calloc(count, size));
+    }
+
+    void* realloc(void* p, size_t size) {
+        return counted(__libc_realloc(p, size));
+    }
+
+    void* memalign(size_t alignment, size_t size) {
+        return counted(__libc_memalign(alignment, size));
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size) {
+        return counted(__libc_memalign(alignment, size));
+    }
+
+    int posix_memalign(void** p, size_t alignment, size_t size) {
+        *p = counted(__libc_memalign(alignment, size));
+        return *p ? 0 : ENOMEM;
+    }
+
+    void free(void* p) {
+        if (p)
+            frees.fetch_add(1, std::memory_order_relaxed);
+        __libc_free(p);
+    }
+}
@@ -0,0 +1,23 @@
+// 把 web 目录打包成 AssetBundle, 服务器启动时 mmap 使用
+// g++ -std=c++17 -I. tools/pack_bundle.cpp bundle.cpp response.cpp -o pack_bundle -lboost_system -lboost_filesystem -lz
+// ./pack_bundle web web.bundle
+#include "bundle.hpp"
+
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <web dir> <bundle file>" << std::endl;
+        return 2;
+    }
+    try {
+        AssetBundle::pack(argv[1], argv[2]);
+        AssetBundle bundle(argv[2]);
+        std::cout << "packed " << bundle.size() << " files into " << argv[2] << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,390 @@
+// 按录制文件 (配置中的 "capture") 重放请求, 输出吞吐、延迟分布和状态码
+// 保留原来的连接: 每个录制的连接对应一个新连接, 连接上的请求按原来的顺序发送, 收到上一个响应以后才发下一个
+// g++ -std=c++17 -O2 -I. tools/replay.cpp capture.cpp -o replay -lboost_system -lpthread
+// ./replay capture.bin 127.0.0.1 8080 [speed]
+// speed 默认为 1, 按录制时的时间发送; 2 表示两倍速; 0 表示不等待, 每个连接都尽快发送
+#include "capture.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <strings.h>
+
+#include <boost/asio.hpp>
+
+using namespace boost::asio;
+
+namespace {
+    typedef std::chrono::steady_clock clock_type;
+
+    struct Step {
+        CaptureRecord::Type type;
+        int64_t time;               // 相对于录制文件中第一条记录的纳秒数
+        std::string data;
+        size_t zeros = 0;
+    };
+
+    struct Stats {
+        size_t connections = 0;
+        size_t requests = 0;
+        size_t errors = 0;
+        size_t streams = 0;         // 101 或者事件流 (text/event-stream), 收到响应头就结束这个连接
+        uint64_t bytes = 0;
+        std::vector<int64_t> latencies;
+        std::map<int, size_t> status;
+        clock_type::time_point last;
+    };
+
+    Stats stats;
+    clock_type::time_point start;
+    double speed = 1;
+    ip::tcp::endpoint endpoint;
+    const char zero_block[64 * 1024] = {};
+
+    // 头部的值中是否有 token (不区分大小写), 比如 "gzip, chunked" 中的 "chunked"
+    bool has_token(const char* value, const char* token) {
+        size_t n = strlen(token);
+        for (const char* p = value; *p && *p != '\r'; p++) {
+            if (strncasecmp(p, token, n) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    class Connection : public std::enable_shared_from_this<Connection> {
+    public:
+        std::vector<Step> steps;
+
+        explicit Connection(io_context& io) : socket_(io), timer_(io) {}
+
+        void run() {
+            auto self = shared_from_this();
+            wait_until(steps.front().time, [self]() {
+                self->socket_.async_connect(endpoint, [self](const boost::system::error_code& ec) {
+                    if (ec)
+                        return self->fail();
+                    stats.connections++;
+                    ip::tcp::no_delay option(true);
+                    boost::system::error_code ignored;
+                    self->socket_.set_option(option, ignored);
+                    self->next_step();
+                });
+            });
+        }
+
+    private:
+        ip::tcp::socket socket_;
+        steady_timer timer_;
+        size_t next_ = 0;
+        streambuf buffer_;
+        clock_type::time_point sent_at_;
+        bool head_ = false;
+        size_t zeros_left_ = 0;
+
+        // 正在读取的 chunked 或者以关闭连接结束的响应体
+        int status_ = 0;
+        uint64_t bytes_ = 0;        // 目前为止响应的字节数, 包括头部和 chunked 的格式
+        size_t chunk_left_ = 0;     // 当前块还没有读到的字节数, 包括块后面的 "\r\n"
+        bool trailer_ = false;      // 已经读到最后一个块 (0), 正在读取 trailer 直到空行
+        bool until_eof_ = false;
+
+        template <class F>
+        void wait_until(int64_t time, F f) {
+            auto at = start + std::chrono::nanoseconds(static_cast<int64_t>(speed > 0 ? time / speed : 0));
+            if (at <= clock_type::now()) {
+                post(socket_.get_executor(), f);
+                return;
+            }
+            timer_.expires_at(at);
+            timer_.async_wait([f](const boost::system::error_code& ec) {
+                if (!ec)
+                    f();
+            });
+        }
+
+        void next_step() {
+            while (next_ < steps.size() && steps[next_].type == CaptureRecord::open)
+                next_++;
+            if (next_ >= steps.size())
+                return close();
+
+            auto self = shared_from_this();
+            wait_until(steps[next_].time, [self]() {
+                auto& step = self->steps[self->next_];
+                switch (step.type) {
+                    case CaptureRecord::request:
+                        self->sent_at_ = clock_type::now();
+                        self->head_ = step.data.compare(0, 5, "HEAD ") == 0;
+                        self->write(buffer(step.data));
+                        break;
+                    case CaptureRecord::body:
+                        self->write(buffer(step.data));
+                        break;
+                    case CaptureRecord::zeros:
+                        self->zeros_left_ = step.zeros;
+                        self->write_zeros();
+                        break;
+                    default:
+                        self->close();
+                        break;
+                }
+            });
+        }
+
+        void write(const_buffer data) {
+            auto self = shared_from_this();
+            async_write(socket_, data, [self](const boost::system::error_code& ec, size_t) {
+                if (ec)
+                    return self->fail();
+                self->sent();
+            });
+        }
+
+        void write_zeros() {
+            auto self = shared_from_this();
+            size_t n = std::min(zeros_left_, sizeof(zero_block));
+            zeros_left_ -= n;
+            async_write(socket_, buffer(zero_block, n), [self](const boost::system::error_code& ec, size_t) {
+                if (ec)
+                    return self->fail();
+                if (self->zeros_left_ > 0)
+                    return self->write_zeros();
+                self->sent();
+            });
+        }
+
+        // 一个请求的最后一段发送完以后读取响应
+        void sent() {
+            next_++;
+            if (next_ < steps.size() && (steps[next_].type == CaptureRecord::body || steps[next_].type == CaptureRecord::zeros))
+                return next_step();
+            read_response();
+        }
+
+        void read_response() {
+            auto self = shared_from_this();
+            async_read_until(socket_, buffer_, "\r\n\r\n", [self](const boost::system::error_code& ec, size_t header_size) {
+                if (ec)
+                    return self->fail();
+
+                std::string header(static_cast<const char*>(self->buffer_.data().data()), header_size);
+                self->buffer_.consume(header_size);
+                int status = 0;
+                if (header.compare(0, 5, "HTTP/") == 0 && header.find(' ') != std::string::npos)
+                    status = std::atoi(header.c_str() + header.find(' ') + 1);
+
+                long long length = -1;
+                bool chunked = false, event_stream = false;
+                for (size_t i = header.find("\r\n"); i != std::string::npos && i + 2 < header.size(); i = header.find("\r\n", i + 2)) {
+                    const char* line = header.c_str() + i + 2;
+                    if (strncasecmp(line, "Content-Length:", 15) == 0)
+                        length = std::atoll(line + 15);
+                    else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+                        chunked = has_token(line + 18, "chunked");
+                    else if (strncasecmp(line, "Content-Type:", 13) == 0)
+                        event_stream = has_token(line + 13, "text/event-stream");
+                }
+                if (self->head_ || status == 204 || status == 304) {
+                    length = 0;
+                    chunked = false;
+                }
+                // 不会结束的响应: 只统计到响应头, 这个连接不再发送后面的请求
+                if (status == 101 || event_stream) {
+                    stats.streams++;
+                    self->finish(status, header_size);
+                    return self->close();
+                }
+                // 延迟算到整个响应体读完
+                if (chunked || length < 0) {
+                    self->status_ = status;
+                    self->bytes_ = header_size;
+                    self->chunk_left_ = 0;
+                    self->trailer_ = false;
+                    self->until_eof_ = !chunked;
+                    return self->read_body();
+                }
+
+                size_t have = std::min<size_t>(self->buffer_.size(), length);
+                self->buffer_.consume(have);
+                if (have == static_cast<size_t>(length)) {
+                    self->finish(status, header_size + length);
+                    return self->next_step();
+                }
+                async_read(self->socket_, self->buffer_, transfer_exactly(length - have),
+                    [self, status, total = header_size + length](const boost::system::error_code& ec, size_t) {
+                        if (ec)
+                            return self->fail();
+                        self->buffer_.consume(self->buffer_.size());
+                        self->finish(status, total);
+                        self->next_step();
+                    });
+            });
+        }
+
+        // 读取 chunked 的响应体直到最后一个块和 trailer, 或者没有长度的响应体直到连接关闭;
+        // 缓冲区中已经有的数据先处理完, 不够时再读
+        void read_body() {
+            while (!until_eof_) {
+                if (chunk_left_ > 0) {
+                    size_t n = std::min(buffer_.size(), chunk_left_);
+                    buffer_.consume(n);
+                    chunk_left_ -= n;
+                    if (chunk_left_ > 0)
+                        return read_more();
+                }
+
+                auto data = buffer_.data();
+                std::string_view view(static_cast<const char*>(data.data()), data.size());
+                size_t eol = view.find("\r\n");
+                if (eol == std::string_view::npos)
+                    return read_more();
+                if (!trailer_) {
+                    // 块大小后面可能有 ";扩展", strtoull 在第一个不是十六进制数字的字符处停止
+                    size_t size = std::strtoull(view.data(), nullptr, 16);
+                    bytes_ += eol + 2 + (size > 0 ? size + 2 : 0);
+                    trailer_ = size == 0;
+                    chunk_left_ = size > 0 ? size + 2 : 0;
+                    buffer_.consume(eol + 2);
+                    continue;
+                }
+                bytes_ += eol + 2;
+                buffer_.consume(eol + 2);
+                if (eol == 0) {
+                    finish(status_, bytes_);
+                    return next_step();
+                }
+            }
+
+            bytes_ += buffer_.size();
+            buffer_.consume(buffer_.size());
+            read_more();
+        }
+
+        void read_more() {
+            auto self = shared_from_this();
+            async_read(socket_, buffer_, transfer_at_least(1), [self](const boost::system::error_code& ec, size_t) {
+                if (ec == error::eof && self->until_eof_) {
+                    self->finish(self->status_, self->bytes_);
+                    return self->close();
+                }
+                if (ec)
+                    return self->fail();
+                self->read_body();
+            });
+        }
+
+        void finish(int status, uint64_t bytes) {
+            auto now = clock_type::now();
+            stats.requests++;
+            stats.bytes += bytes;
+            stats.status[status]++;
+            stats.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent_at_).count());
+            stats.last = std::max(stats.last, now);
+        }
+
+        void fail() {
+            stats.errors++;
+            close();
+        }
+
+        void close() {
+            boost::system::error_code ignored;
+            timer_.cancel();
+            socket_.close(ignored);
+        }
+    };
+
+    // 录制的连接编号在连接关闭以后会被重用, 按 open / close 切分
+    std::vector<std::shared_ptr<Connection>> load(const std::string& path, io_context& io) {
+        CaptureReader reader(path);
+        std::vector<std::shared_ptr<Connection>> connections;
+        std::unordered_map<uint64_t, std::shared_ptr<Connection>> current;
+        CaptureRecord record;
+        std::string data;
+        bool first = true;
+        uint64_t base = 0;
+        while (reader.next(record, data)) {
+            if (first) {
+                base = record.time;
+                first = false;
+            }
+            auto& connection = current[record.connection];
+            if (!connection || record.type == CaptureRecord::open) {
+                // 开始录制之前就已经存在的连接, 只有 close 时没有需要重放的内容
+                if (record.type == CaptureRecord::close && !connection) {
+                    current.erase(record.connection);
+                    continue;
+                }
+                connection = std::make_shared<Connection>(io);
+                connections.push_back(connection);
+            }
+            Step step{static_cast<CaptureRecord::Type>(record.type), static_cast<int64_t>(record.time - base), std::move(data)};
+            if (record.type == CaptureRecord::zeros)
+                step.zeros = record.size;
+            connection->steps.push_back(std::move(step));
+            if (record.type == CaptureRecord::close)
+                current.erase(record.connection);
+        }
+        return connections;
+    }
+
+    double percentile(const std::vector<int64_t>& sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()));
+        return sorted[i] / 1e6;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5) {
+        std::cerr << "usage: " << argv[0] << " <capture file> <address> <port> [speed]" << std::endl;
+        return 2;
+    }
+    try {
+        io_context io;
+        endpoint = ip::tcp::endpoint(ip::make_address(argv[2]), static_cast<unsigned short>(std::atoi(argv[3])));
+        if (argc == 5)
+            speed = std::atof(argv[4]);
+
+        auto connections = load(argv[1], io);
+        start = clock_type::now();
+        stats.last = start;
+        for (auto& connection : connections)
+            connection->run();
+        connections.clear();
+        io.run();
+
+        double elapsed = std::chrono::duration<double>(stats.last - start).count();
+        auto& latencies = stats.latencies;
+        std::sort(latencies.begin(), latencies.end());
+
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "connections " << stats.connections << ", requests " << stats.requests
+                  << " (errors " << stats.errors << ", streams " << stats.streams << ")" << std::endl;
+        if (elapsed > 0)
+            std::cout << "elapsed " << elapsed << "s, " << stats.requests / elapsed << " req/s, "
+                      << stats.bytes / elapsed / 1e6 << " MB/s received" << std::endl;
+        std::cout << "latency ms: p50 " << percentile(latencies, 50) << "  p90 " << percentile(latencies, 90)
+                  << "  p99 " << percentile(latencies, 99) << "  p99.9 " << percentile(latencies, 99.9)
+                  << "  max " << (latencies.empty() ? 0 : latencies.back() / 1e6) << std::endl;
+        std::cout << "status";
+        for (auto& s : stats.status)
+            std::cout << "  " << s.first << ": " << s.second;
+        std::cout << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "trace.hpp"
+
+#include <fstream>
+#include <iomanip>
+
+namespace {
+    const char* phase_names[RequestTrace::num_phases] = {
+        "idle", "read header", "parse", "read body", "route", "handler", "write"
+    };
+
+    // 每个 io 线程一个从 1 开始的编号, 比 std::thread::id 更适合在 trace 中显示
+    size_t thread_index() {
+        static std::atomic<size_t> next{1};
+        thread_local size_t index = next.fetch_add(1);
+        return index;
+    }
+
+    void json_escape(std::ostream& out, const std::string& s) {
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (c < 0x20)
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+            else
+                out << c;
+        }
+    }
+}
+
+Tracer::Tracer(double slow_threshold_ms, size_t capacity)
+    : threshold_ns_(static_cast<int64_t>(slow_threshold_ms * 1e6)), ring_(capacity > 0 ? capacity : 1) {
+}
+
+void Tracer::record(const RequestTrace& trace, std::string_view method, std::string_view path) {
+    total_.fetch_add(1, std::memory_order_relaxed);
+    if (trace.latency() < threshold_ns_)
+        return;
+    slow_.fetch_add(1, std::memory_order_relaxed);
+
+    size_t thread = thread_index();
+    std::lock_guard<std::mutex> lock(mutex_);
+    Sample& sample = ring_[next_];
+    sample.trace = trace;
+    sample.method = method;
+    sample.path = path;
+    sample.thread = thread;
+    next_ = (next_ + 1) % ring_.size();
+    if (size_ < ring_.size())
+        size_++;
+}
+
+std::vector<Tracer::Sample> Tracer::snapshot() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Sample> samples;
+    samples.reserve(size_);
+    size_t first = (next_ + ring_.size() - size_) % ring_.size();
+    for (size_t i = 0; i < size_; i++)
+        samples.push_back(ring_[(first + i) % ring_.size()]);
+    return samples;
+}
+
+void Tracer::dump_text(std::ostream& out) {
+    auto samples = snapshot();
+    out << "requests: " << total_.load() << ", slow (>= " << threshold_ns_ / 1e6 << " ms): " << slow_.load()
+        << ", sampled: " << samples.size() << "\n";
+    out << std::fixed << std::setprecision(3);
+    for (auto& s : samples) {
+        out << "thread " << s.thread << " " << s.method << " " << s.path << " total " << s.trace.latency() / 1e6 << " ms:";
+        int64_t prev = 0;
+        for (int p = RequestTrace::read_start; p < RequestTrace::num_phases; p++) {
+            int64_t t = s.trace.t[p];
+            if (t == 0)
+                continue;
+            if (prev != 0)
+                out << " " << phase_names[p] << " " << (t - prev) / 1e6;
+            prev = t;
+        }
+        out << "\n";
+    }
+}
+
+void Tracer::dump_chrome(std::ostream& out) {
+    auto samples = snapshot();
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    out << std::fixed << std::setprecision(3);
+    for (auto& s : samples) {
+        int64_t prev = 0;
+        for (int p = RequestTrace::read_start; p < RequestTrace::num_phases; p++) {
+            int64_t t = s.trace.t[p];
+            if (t == 0)
+                continue;
+            // 长连接上的空闲等待不画出来, 否则会盖住真正的请求处理时间
+            if (prev != 0 && p != RequestTrace::header_read) {
+                out << (first ? "" : ",") << "{\"name\":\"" << phase_names[p] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << s.thread
+                    << ",\"ts\":" << prev / 1e3 << ",\"dur\":" << (t - prev) / 1e3 << ",\"args\":{\"request\":\"";
+                json_escape(out, s.method + " " + s.path);
+                out << "\"}}";
+                first = false;
+            }
+            prev = t;
+        }
+    }
+    out << "]}";
+}
+
+bool Tracer::dump_file(const std::string& path) {
+    std::ofstream out(path, std::ios::out | std::ios::trunc);
+    if (!out)
+        return false;
+    dump_chrome(out);
+    return static_cast<bool>(out);
+}
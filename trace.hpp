@@ -0,0 +1,78 @@
+#ifndef TRACE_HPP
+#define	TRACE_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// 单个请求在各个阶段的时间戳 (steady_clock 纳秒, 0 表示没有经过这个阶段)
+struct RequestTrace {
+    enum Phase {
+        read_start,     // 开始等待请求头 (长连接上包含空闲等待的时间)
+        header_read,    // async_read_until 完成
+        parsed,         // parse_request 完成
+        body_read,      // 请求体读取完成
+        routed,         // 在 resources_ 中找到处理函数
+        handled,        // 处理函数返回
+        written,        // async_write 完成
+        num_phases
+    };
+
+    std::array<int64_t, num_phases> t{};
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void mark(Phase phase) { t[phase] = now(); }
+    void mark(Phase phase, int64_t time) { t[phase] = time; }
+
+    // 从读到完整请求头到响应写完的时间, 不包含长连接上的空闲等待
+    int64_t latency() const { return t[written] && t[header_read] ? t[written] - t[header_read] : 0; }
+};
+
+// 慢请求采样器: 超过阈值的请求放进一个固定大小的环形缓冲区, 可以通过管理接口或者信号导出
+class Tracer {
+public:
+    Tracer(double slow_threshold_ms, size_t capacity = 1024);
+
+    // 请求完成时调用, 快于阈值的请求只做一次比较和两次原子加
+    void record(const RequestTrace& trace, std::string_view method, std::string_view path);
+
+    // 文本格式, 每个慢请求一行, 列出每个阶段耗费的时间
+    void dump_text(std::ostream& out);
+
+    // Chrome trace / Perfetto 可以直接打开的 JSON
+    void dump_chrome(std::ostream& out);
+
+    bool dump_file(const std::string& path);
+
+private:
+    struct Sample {
+        RequestTrace trace;
+        std::string method;
+        std::string path;
+        size_t thread = 0;
+    };
+
+    int64_t threshold_ns_;
+    std::mutex mutex_;
+    std::vector<Sample> ring_;
+    size_t next_ = 0;
+    size_t size_ = 0;
+
+    std::atomic<uint64_t> total_{0};
+    std::atomic<uint64_t> slow_{0};
+
+    std::vector<Sample> snapshot();
+};
+
+#endif	/* TRACE_HPP */
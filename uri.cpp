@@ -0,0 +1,149 @@
+#include "uri.hpp"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+    int hex(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    bool key_equals(std::string_view key, std::string_view name) {
+        if (key.find_first_of("%+") == std::string_view::npos)
+            return key == name;
+        // 参数名里有转义的情况很少, 这时才解码
+        std::string decoded(key);
+        size_t n = http::percent_decode(&decoded[0], decoded.size(), true);
+        return n != std::string::npos && std::string_view(decoded.data(), n) == name;
+    }
+}
+
+namespace http {
+
+    size_t percent_decode(char* s, size_t size, bool plus_as_space) {
+        // 第一个需要处理的字符之前的部分不用移动
+        size_t i = 0;
+        if (!plus_as_space) {
+            auto p = static_cast<char*>(std::memchr(s, '%', size));
+            if (p == nullptr)
+                return size;
+            i = p - s;
+        }
+        size_t out = i;
+        for (; i < size; i++) {
+            char c = s[i];
+            if (c == '%') {
+                if (i + 2 >= size)
+                    return std::string::npos;
+                int high = hex(s[i + 1]), low = hex(s[i + 2]);
+                if (high < 0 || low < 0 || (high | low) == 0)
+                    return std::string::npos;
+                c = static_cast<char>(high * 16 + low);
+                i += 2;
+            }
+            else if (c == '+' && plus_as_space) {
+                c = ' ';
+            }
+            s[out++] = c;
+        }
+        return out;
+    }
+
+    size_t remove_dot_segments(char* s, size_t size) {
+        // 每段从 '/' 开始, 输出不会比输入长, 可以就地拷贝
+        size_t out = 0;
+        size_t i = 0;
+        while (i < size) {
+            size_t j = i + 1;
+            while (j < size && s[j] != '/')
+                j++;
+            size_t n = j - i - 1;
+            if (n == 1 && s[i + 1] == '.') {
+                // "/a/./b" -> "/a/b", 在末尾时 "/a/." -> "/a/"
+                if (j == size)
+                    s[out++] = '/';
+            }
+            else if (n == 2 && s[i + 1] == '.' && s[i + 2] == '.') {
+                // 去掉输出中的最后一段, 已经在根目录时不变
+                while (out > 0 && s[out - 1] != '/')
+                    out--;
+                if (out > 0)
+                    out--;
+                if (j == size)
+                    s[out++] = '/';
+            }
+            else {
+                if (out != i)
+                    std::memmove(s + out, s + i, j - i);
+                out += j - i;
+            }
+            i = j;
+        }
+        return out;
+    }
+
+    bool is_normal_path(const char* s, size_t size) {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i percent = _mm_set1_epi8('%');
+        const __m128i slash = _mm_set1_epi8('/');
+        const __m128i dot = _mm_set1_epi8('.');
+        for (; i + 17 <= size; i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 1));
+            __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(a, percent),
+                                       _mm_and_si128(_mm_cmpeq_epi8(a, slash), _mm_cmpeq_epi8(b, dot)));
+            if (_mm_movemask_epi8(bad) != 0)
+                return false;
+        }
+#endif
+        for (; i < size; i++) {
+            if (s[i] == '%' || (s[i] == '/' && i + 1 < size && s[i + 1] == '.'))
+                return false;
+        }
+        return true;
+    }
+
+    bool parse_target(std::string_view target, std::pmr::string& path, size_t& query) {
+        size_t question = target.find('?');
+        query = question == std::string_view::npos ? target.size() : question + 1;
+        path.assign(target.substr(0, question));
+        if (path.empty() || path[0] != '/' || is_normal_path(path.data(), path.size()))
+            return true;
+
+        // 先解码再去掉 "..", 这样 "%2e%2e" 也会被处理
+        size_t n = percent_decode(&path[0], path.size());
+        if (n == std::string::npos)
+            return false;
+        path.resize(remove_dot_segments(&path[0], n));
+        return true;
+    }
+
+    bool query_param(std::string_view query, std::string_view name, std::pmr::string& value) {
+        while (!query.empty()) {
+            size_t amp = query.find('&');
+            auto pair = query.substr(0, amp);
+            query.remove_prefix(amp == std::string_view::npos ? query.size() : amp + 1);
+
+            size_t eq = pair.find('=');
+            if (!key_equals(pair.substr(0, eq), name))
+                continue;
+            value.assign(eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1));
+            // 转义非法时保留原样
+            size_t n = percent_decode(&value[0], value.size(), true);
+            if (n != std::string::npos)
+                value.resize(n);
+            return true;
+        }
+        return false;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef URI_HPP
+#define	URI_HPP
+
+#include <memory_resource>
+#include <string>
+#include <string_view>
+
+
+// 请求行中 request-target 的处理: 拆分路径和查询、百分号解码、去掉 "." 和 ".." 段
+namespace http {
+
+    // 就地百分号解码, 返回解码后的长度; 转义不完整或者解码出 NUL 时返回 npos
+    // plus_as_space: 查询参数中 '+' 表示空格 (application/x-www-form-urlencoded)
+    size_t percent_decode(char* s, size_t size, bool plus_as_space = false);
+
+    // 去掉 "." 和 ".." 段 (RFC 3986 5.2.4), 就地修改, 返回新的长度; s 以 '/' 开头, ".." 不会退到根目录之外
+    size_t remove_dot_segments(char* s, size_t size);
+
+    // 路径中没有 '%' 也没有 "/." 时不需要解码和规范化, SSE2 一次检查 16 字节
+    bool is_normal_path(const char* s, size_t size);
+
+    // 把 target 中 '?' 之前的部分解码、规范化后写入 path, query 为查询在 target 中的起始位置 (没有查询时为 target.size())
+    // 不以 '/' 开头的 target ("*" 或者 absolute-form) 原样保留; 转义非法时返回 false
+    bool parse_target(std::string_view target, std::pmr::string& path, size_t& query);
+
+    // 在 "a=1&b=x%20y" 这样的查询中找 name, 找到时把解码后的值写入 value
+    // 不预先拆分整个查询, 每次调用从头扫描一遍, 只解码找到的那个值
+    bool query_param(std::string_view query, std::string_view name, std::pmr::string& value);
+}
+
+#endif	/* URI_HPP */
@@ -0,0 +1,617 @@
+#include "websocket.hpp"
+
+#include <cstring>
+
+#include <boost/uuid/detail/sha1.hpp>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+    const char* websocket_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    enum Opcode {
+        continuation_frame = 0x0, text_frame = 0x1, binary_frame = 0x2, close_frame = 0x8, ping_frame = 0x9, pong_frame = 0xa
+    };
+
+    std::string base64(const unsigned char* data, size_t size) {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        out.reserve((size + 2) / 3 * 4);
+        for (size_t i = 0; i < size; i += 3) {
+            uint32_t n = data[i] << 16;
+            if (i + 1 < size) n |= data[i + 1] << 8;
+            if (i + 2 < size) n |= data[i + 2];
+            out += table[(n >> 18) & 63];
+            out += table[(n >> 12) & 63];
+            out += i + 1 < size ? table[(n >> 6) & 63] : '=';
+            out += i + 2 < size ? table[n & 63] : '=';
+        }
+        return out;
+    }
+
+    bool iequals(std::string_view a, std::string_view b) {
+        return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    std::string_view trim(std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+            s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+            s.remove_suffix(1);
+        return s;
+    }
+
+    // 可以出现在关闭帧中的状态码
+    bool valid_close_code(int code) {
+        return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+    }
+
+    // permessage-deflate (no_context_takeover): 每条消息之前 reset, 所以每个线程一个 z_stream 就够了
+    struct Deflater {
+        z_stream z{};
+
+        Deflater() { deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); }
+        ~Deflater() { deflateEnd(&z); }
+
+        // 压缩一条消息, 去掉 Z_SYNC_FLUSH 末尾的 00 00 ff ff (RFC 7692 7.2.1)
+        void compress(std::string_view in, std::string& out) {
+            deflateReset(&z);
+            out.resize(deflateBound(&z, in.size()) + 16);
+            z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+            z.avail_in = static_cast<uInt>(in.size());
+            size_t used = 0;
+            for (;;) {
+                z.next_out = reinterpret_cast<Bytef*>(&out[used]);
+                z.avail_out = static_cast<uInt>(out.size() - used);
+                deflate(&z, Z_SYNC_FLUSH);
+                used = out.size() - z.avail_out;
+                if (z.avail_out > 0)
+                    break;
+                out.resize(out.size() * 2);
+            }
+            out.resize(used);
+            if (used >= 4 && memcmp(&out[used - 4], "\x00\x00\xff\xff", 4) == 0)
+                out.resize(used - 4);
+        }
+    };
+
+    struct Inflater {
+        z_stream z{};
+
+        Inflater() { inflateInit2(&z, -15); }
+        ~Inflater() { inflateEnd(&z); }
+
+        // 解压一条消息, 返回 0 或者关闭连接用的状态码
+        int decompress(const char* data, size_t size, std::string& out, size_t max_size) {
+            static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+            inflateReset(&z);
+            if (out.size() < 4096)
+                out.resize(4096);
+            size_t used = 0;
+
+            const unsigned char* inputs[2] = {reinterpret_cast<const unsigned char*>(data), tail};
+            size_t sizes[2] = {size, sizeof(tail)};
+            for (int i = 0; i < 2; i++) {
+                z.next_in = const_cast<Bytef*>(inputs[i]);
+                z.avail_in = static_cast<uInt>(sizes[i]);
+                while (z.avail_in > 0) {
+                    if (used == out.size())
+                        out.resize(out.size() * 2);
+                    z.next_out = reinterpret_cast<Bytef*>(&out[used]);
+                    z.avail_out = static_cast<uInt>(out.size() - used);
+                    int r = inflate(&z, Z_SYNC_FLUSH);
+                    used = out.size() - z.avail_out;
+                    if (used > max_size)
+                        return 1009;
+                    if (r == Z_STREAM_END)
+                        break;
+                    if (r != Z_OK && !(r == Z_BUF_ERROR && z.avail_out == 0))
+                        return 1007;
+                }
+            }
+            out.resize(used);
+            return 0;
+        }
+    };
+
+    thread_local Deflater deflater;
+    thread_local Inflater inflater;
+}
+
+WebSocket::WebSocket(std::shared_ptr<socket_type> socket, const Handler& handler, const Options& options, bool deflate)
+    : socket_(std::move(socket)), strand_(boost::asio::make_strand(socket_->get_executor())),
+    handler_(handler), options_(options), deflate_(deflate) {
+}
+
+std::string WebSocket::accept_key(std::string_view key) {
+    boost::uuids::detail::sha1 sha1;
+    sha1.process_bytes(key.data(), key.size());
+    sha1.process_bytes(websocket_guid, strlen(websocket_guid));
+    boost::uuids::detail::sha1::digest_type digest;
+    sha1.get_digest(digest);
+
+    unsigned char bytes[20];
+    for (int i = 0; i < 5; i++) {
+        bytes[i * 4] = (digest[i] >> 24) & 0xff;
+        bytes[i * 4 + 1] = (digest[i] >> 16) & 0xff;
+        bytes[i * 4 + 2] = (digest[i] >> 8) & 0xff;
+        bytes[i * 4 + 3] = digest[i] & 0xff;
+    }
+    return base64(bytes, sizeof(bytes));
+}
+
+bool WebSocket::accept_deflate(std::string_view extensions) {
+    // 客户端可以给出多个候选, 用逗号分开, 每个候选的参数用分号分开
+    while (!extensions.empty()) {
+        auto comma = extensions.find(',');
+        std::string_view offer = extensions.substr(0, comma);
+        extensions = comma == std::string_view::npos ? std::string_view() : extensions.substr(comma + 1);
+
+        auto semicolon = offer.find(';');
+        if (!iequals(trim(offer.substr(0, semicolon)), "permessage-deflate"))
+            continue;
+
+        bool acceptable = true;
+        while (semicolon != std::string_view::npos && acceptable) {
+            offer = offer.substr(semicolon + 1);
+            semicolon = offer.find(';');
+            std::string_view param = trim(offer.substr(0, semicolon));
+            auto eq = param.find('=');
+            std::string_view name = trim(param.substr(0, eq));
+            std::string_view value = eq == std::string_view::npos ? std::string_view() : trim(param.substr(eq + 1));
+            if (!value.empty() && value.front() == '"' && value.size() >= 2)
+                value = value.substr(1, value.size() - 2);
+
+            if (iequals(name, "server_no_context_takeover") || iequals(name, "client_no_context_takeover") ||
+                iequals(name, "client_max_window_bits"))
+                continue;
+            // 服务端压缩固定使用 15 位窗口, 要求更小的窗口时拒绝这个候选
+            if (iequals(name, "server_max_window_bits") && value == "15")
+                continue;
+            acceptable = false;
+        }
+        if (acceptable)
+            return true;
+    }
+    return false;
+}
+
+void WebSocket::unmask(char* data, size_t size, const unsigned char key[4]) {
+    uint32_t k;
+    memcpy(&k, key, 4);
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i mask = _mm_set1_epi32(static_cast<int>(k));
+    for (; i + 64 <= size; i += 64) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(a, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i + 16), _mm_xor_si128(b, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i + 32), _mm_xor_si128(c, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i + 48), _mm_xor_si128(d, mask));
+    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(a, mask));
+    }
+#endif
+    // i 始终是 4 的倍数, 剩下的部分掩码从 key[0] 开始
+    uint64_t k8 = (static_cast<uint64_t>(k) << 32) | k;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= k8;
+        memcpy(data + i, &v, 8);
+    }
+    for (; i < size; i++)
+        data[i] ^= key[i & 3];
+}
+
+bool WebSocket::valid_utf8(const char* data, size_t size) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (i < size) {
+#ifdef __SSE2__
+        // 16 个字节的最高位都是 0 (都是 ASCII) 时整块跳过
+        while (i + 16 <= size && _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i))) == 0)
+            i += 16;
+        if (i >= size)
+            break;
+#endif
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        size_t len;
+        uint32_t cp;
+        if ((c & 0xe0) == 0xc0) {
+            len = 2;
+            cp = c & 0x1f;
+        }
+        else if ((c & 0xf0) == 0xe0) {
+            len = 3;
+            cp = c & 0x0f;
+        }
+        else if ((c & 0xf8) == 0xf0) {
+            len = 4;
+            cp = c & 0x07;
+        }
+        else
+            return false;
+
+        if (i + len > size)
+            return false;
+        for (size_t k = 1; k < len; k++) {
+            if ((s[i + k] & 0xc0) != 0x80)
+                return false;
+            cp = (cp << 6) | (s[i + k] & 0x3f);
+        }
+        // 过长编码、代理对、超出 U+10FFFF
+        if ((len == 2 && cp < 0x80) || (len == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) ||
+            (len == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+            return false;
+        i += len;
+    }
+    return true;
+}
+
+void WebSocket::start(std::string initial) {
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [self, initial = std::move(initial)]() mutable {
+        boost::system::error_code ignored;
+        self->socket_->non_blocking(true, ignored);
+        if (!initial.empty()) {
+            self->partial_ = std::move(initial);
+            size_t used = self->consume(&self->partial_[0], self->partial_.size());
+            self->partial_.erase(0, used);
+        }
+        if (!self->close_received_ && !self->failed_ && !self->finished_)
+            self->read();
+    });
+}
+
+void WebSocket::read() {
+    // 不预先分配读缓冲区, 等 socket 可读以后再读
+    auto self = shared_from_this();
+    socket_->async_wait(socket_type::wait_read, boost::asio::bind_executor(strand_, [self](const boost::system::error_code& ec) {
+        self->on_readable(ec);
+    }));
+}
+
+void WebSocket::on_readable(const boost::system::error_code& ec) {
+    if (finished_)
+        return;
+    if (ec) {
+        finish(close_received_ ? close_code_ : 1006);
+        return;
+    }
+
+    thread_local char buffer[64 * 1024];
+    boost::system::error_code rec;
+    size_t n = socket_->read_some(boost::asio::buffer(buffer), rec);
+    if (rec == boost::asio::error::would_block || rec == boost::asio::error::try_again) {
+        read();
+        return;
+    }
+    if (rec) {
+        finish(close_received_ ? close_code_ : 1006);
+        return;
+    }
+
+    // 没有剩余的半个帧时直接在线程局部的缓冲区上解析, 只把不完整的部分留在连接上
+    if (partial_.empty()) {
+        size_t used = consume(buffer, n);
+        partial_.assign(buffer + used, n - used);
+    }
+    else {
+        partial_.append(buffer, n);
+        size_t used = consume(&partial_[0], partial_.size());
+        partial_.erase(0, used);
+    }
+    if (partial_.empty())
+        std::string().swap(partial_);
+
+    if (!close_received_ && !failed_ && !finished_)
+        read();
+}
+
+size_t WebSocket::consume(char* data, size_t size) {
+    size_t pos = 0;
+    while (!close_received_ && !failed_ && !finished_) {
+        if (size - pos < 2)
+            break;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data + pos);
+        bool fin = p[0] & 0x80;
+        bool rsv1 = p[0] & 0x40;
+        int opcode = p[0] & 0x0f;
+        uint64_t len = p[1] & 0x7f;
+        size_t header = 2;
+
+        if (p[0] & 0x30) {
+            fail(1002);
+            break;
+        }
+        // 客户端发来的帧必须带掩码
+        if (!(p[1] & 0x80)) {
+            fail(1002);
+            break;
+        }
+
+        if (len == 126) {
+            if (size - pos < 4)
+                break;
+            len = (p[2] << 8) | p[3];
+            header = 4;
+        }
+        else if (len == 127) {
+            if (size - pos < 10)
+                break;
+            len = 0;
+            for (int i = 2; i < 10; i++)
+                len = (len << 8) | p[i];
+            header = 10;
+        }
+        if (len > options_.max_message) {
+            fail(1009);
+            break;
+        }
+        header += 4;
+        if (size - pos < header + len)
+            break;
+
+        unsigned char key[4];
+        memcpy(key, data + pos + header - 4, 4);
+        char* payload = data + pos + header;
+        unmask(payload, len, key);
+        pos += header + len;
+
+        on_frame(fin, rsv1, opcode, payload, len);
+    }
+    return pos;
+}
+
+void WebSocket::on_frame(bool fin, bool rsv1, int opcode, char* payload, size_t size) {
+    // 控制帧: 不能分片, 最长 125 字节, 可以插在分片消息的中间
+    if (opcode & 0x8) {
+        if (!fin || rsv1 || size > 125) {
+            fail(1002);
+            return;
+        }
+        switch (opcode) {
+        case close_frame: {
+            int code = 1005;
+            if (size == 1) {
+                fail(1002);
+                return;
+            }
+            if (size >= 2) {
+                code = (static_cast<unsigned char>(payload[0]) << 8) | static_cast<unsigned char>(payload[1]);
+                if (!valid_close_code(code)) {
+                    fail(1002);
+                    return;
+                }
+                if (!valid_utf8(payload + 2, size - 2)) {
+                    fail(1007);
+                    return;
+                }
+            }
+            close_received_ = true;
+            close_code_ = code;
+            if (!close_sent_)
+                send_close(code == 1005 ? 1000 : code);
+            else if (!writing_active_ && pending_.empty())
+                finish(code);
+            return;
+        }
+        case ping_frame:
+            enqueue(pong_frame, std::string_view(payload, size), false);
+            return;
+        case pong_frame:
+            return;
+        default:
+            fail(1002);
+            return;
+        }
+    }
+
+    if (opcode == continuation_frame) {
+        if (message_opcode_ == 0 || rsv1) {
+            fail(1002);
+            return;
+        }
+    }
+    else if (opcode == text_frame || opcode == binary_frame) {
+        if (message_opcode_ != 0 || (rsv1 && !deflate_)) {
+            fail(1002);
+            return;
+        }
+    }
+    else {
+        fail(1002);
+        return;
+    }
+
+    // 没有分片的消息直接交给处理函数, 不拷贝
+    if (opcode != continuation_frame && fin) {
+        deliver(opcode, payload, size, rsv1);
+        return;
+    }
+
+    if (opcode != continuation_frame) {
+        message_opcode_ = opcode;
+        message_compressed_ = rsv1;
+        message_.assign(payload, size);
+    }
+    else {
+        if (message_.size() + size > options_.max_message) {
+            fail(1009);
+            return;
+        }
+        message_.append(payload, size);
+    }
+
+    if (fin) {
+        int message_opcode = message_opcode_;
+        message_opcode_ = 0;
+        deliver(message_opcode, message_.data(), message_.size(), message_compressed_);
+        std::string().swap(message_);
+    }
+}
+
+void WebSocket::deliver(int opcode, const char* data, size_t size, bool compressed) {
+    thread_local std::string inflated;
+    if (compressed) {
+        int code = inflater.decompress(data, size, inflated, options_.max_message);
+        if (code != 0) {
+            fail(code);
+            return;
+        }
+        data = inflated.data();
+        size = inflated.size();
+    }
+
+    if (opcode == text_frame && !valid_utf8(data, size)) {
+        fail(1007);
+        return;
+    }
+    if (handler_.on_message)
+        handler_.on_message(shared_from_this(), std::string_view(data, size), opcode == binary_frame);
+}
+
+void WebSocket::send(std::string_view message, bool binary) {
+    // 压缩在调用线程上完成, 用的是调用线程的 z_stream
+    thread_local std::string compressed;
+    std::string_view payload = message;
+    bool rsv1 = false;
+    if (deflate_ && message.size() >= options_.deflate_min) {
+        deflater.compress(message, compressed);
+        if (compressed.size() < message.size()) {
+            payload = compressed;
+            rsv1 = true;
+        }
+    }
+
+    int opcode = binary ? binary_frame : text_frame;
+    if (strand_.running_in_this_thread()) {
+        if (!close_sent_)
+            enqueue(opcode, payload, rsv1);
+        return;
+    }
+
+    auto self = shared_from_this();
+    auto data = std::make_shared<std::string>(payload);
+    boost::asio::post(strand_, [self, data, opcode, rsv1]() {
+        if (!self->close_sent_)
+            self->enqueue(opcode, *data, rsv1);
+    });
+}
+
+void WebSocket::close(int code) {
+    auto self = shared_from_this();
+    boost::asio::dispatch(strand_, [self, code]() {
+        self->send_close(code);
+    });
+}
+
+void WebSocket::enqueue(int opcode, std::string_view payload, bool compressed) {
+    if (finished_)
+        return;
+
+    // 服务端发出的帧不带掩码
+    unsigned char header[10];
+    size_t n = 2;
+    header[0] = 0x80 | (compressed ? 0x40 : 0) | opcode;
+    if (payload.size() < 126) {
+        header[1] = static_cast<unsigned char>(payload.size());
+    }
+    else if (payload.size() <= 0xffff) {
+        header[1] = 126;
+        header[2] = (payload.size() >> 8) & 0xff;
+        header[3] = payload.size() & 0xff;
+        n = 4;
+    }
+    else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++)
+            header[2 + i] = (static_cast<uint64_t>(payload.size()) >> (56 - 8 * i)) & 0xff;
+        n = 10;
+    }
+    pending_.append(reinterpret_cast<const char*>(header), n);
+    pending_.append(payload.data(), payload.size());
+    schedule_flush();
+}
+
+void WebSocket::schedule_flush() {
+    // 推迟到这一轮处理结束以后再写, 这期间产生的帧合并成一次写
+    if (flush_scheduled_ || writing_active_)
+        return;
+    flush_scheduled_ = true;
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [self]() {
+        self->flush_scheduled_ = false;
+        self->flush();
+    });
+}
+
+void WebSocket::flush() {
+    if (writing_active_ || pending_.empty() || finished_)
+        return;
+    writing_active_ = true;
+    writing_.swap(pending_);
+
+    auto self = shared_from_this();
+    boost::asio::async_write(*socket_, boost::asio::buffer(writing_), boost::asio::bind_executor(strand_,
+        [self](const boost::system::error_code& ec, size_t bytes_transferred) {
+            self->writing_active_ = false;
+            self->writing_.clear();
+            if (ec) {
+                self->finish(1006);
+                return;
+            }
+            // 发送过大消息以后释放缓冲区, 空闲连接不占内存
+            if (self->writing_.capacity() > 64 * 1024)
+                std::string().swap(self->writing_);
+
+            if (!self->pending_.empty())
+                self->flush();
+            else if (self->close_sent_ && (self->close_received_ || self->failed_))
+                self->finish(self->close_code_);
+        }));
+}
+
+void WebSocket::send_close(int code) {
+    if (close_sent_ || finished_)
+        return;
+    char payload[2] = {static_cast<char>((code >> 8) & 0xff), static_cast<char>(code & 0xff)};
+    enqueue(close_frame, std::string_view(payload, sizeof(payload)), false);
+    close_sent_ = true;
+}
+
+void WebSocket::fail(int code) {
+    failed_ = true;
+    close_code_ = code;
+    send_close(code);
+}
+
+void WebSocket::finish(int code) {
+    if (finished_)
+        return;
+    finished_ = true;
+
+    boost::system::error_code ignored;
+    socket_->shutdown(socket_type::shutdown_both, ignored);
+    socket_->close(ignored);
+    std::string().swap(partial_);
+    std::string().swap(message_);
+    std::string().swap(pending_);
+
+    if (handler_.on_close)
+        handler_.on_close(shared_from_this(), code);
+}
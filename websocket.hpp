@@ -0,0 +1,101 @@
+#ifndef WEBSOCKET_HPP
+#define	WEBSOCKET_HPP
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <boost/asio.hpp>
+
+
+struct Request;
+
+// RFC 6455 WebSocket 连接
+// 握手由 HTTPServer 完成, 之后连接交给 WebSocket: 读写都在自己的 strand 上串行执行,
+// send() 可以在任意线程调用。空闲时不持有读缓冲区 (等 socket 可读以后读到线程局部的缓冲区里),
+// 只有收到不完整的帧时才保存剩下的字节, 所以大量空闲连接只占很少的内存。
+// permessage-deflate 只支持 no_context_takeover, 压缩和解压用的 z_stream 每个线程一份, 不属于连接
+class WebSocket : public std::enable_shared_from_this<WebSocket> {
+public:
+    typedef boost::asio::generic::stream_protocol::socket socket_type;
+
+    // 按路径注册到 HTTPServer::websocket_ 中, 用法与 resources_ 类似
+    struct Handler {
+        std::function<void(std::shared_ptr<WebSocket>, const Request&)> on_open;
+        std::function<void(std::shared_ptr<WebSocket>, std::string_view message, bool binary)> on_message;
+        std::function<void(std::shared_ptr<WebSocket>, int code)> on_close;
+    };
+
+    struct Options {
+        size_t max_message = 16 * 1024 * 1024;  // 一条消息 (解压以后) 的最大长度, 超过时以 1009 关闭
+        bool deflate = true;                    // 客户端请求时是否启用 permessage-deflate
+        size_t deflate_min = 64;                // 短于这个长度的消息不压缩
+    };
+
+    WebSocket(std::shared_ptr<socket_type> socket, const Handler& handler, const Options& options, bool deflate);
+
+    // 握手时读请求头多读到的字节 (客户端紧接着发来的帧) 通过 initial 传入
+    void start(std::string initial);
+
+    // 发送一条文本或二进制消息; 同一轮处理中发送的多条消息会合并成一次写
+    void send(std::string_view message, bool binary = false);
+
+    void close(int code = 1000);
+
+    // 握手用: Sec-WebSocket-Accept 的值
+    static std::string accept_key(std::string_view key);
+
+    // 客户端在 Sec-WebSocket-Extensions 中请求了可以接受的 permessage-deflate
+    static bool accept_deflate(std::string_view extensions);
+
+    static const char* deflate_response() {
+        return "permessage-deflate; server_no_context_takeover; client_no_context_takeover";
+    }
+
+    // 按 4 字节的掩码异或 payload, SSE2 每次处理 16 字节
+    static void unmask(char* data, size_t size, const unsigned char key[4]);
+
+    // 检查 UTF-8 是否合法, ASCII 部分用 SSE2 每次跳过 16 字节
+    static bool valid_utf8(const char* data, size_t size);
+
+private:
+    std::shared_ptr<socket_type> socket_;
+    boost::asio::strand<socket_type::executor_type> strand_;
+    const Handler& handler_;
+    const Options& options_;
+    bool deflate_;
+
+    std::string partial_;           // 不完整的帧
+    std::string message_;           // 分片消息拼接中
+    int message_opcode_ = 0;        // 0 表示没有正在拼接的消息
+    bool message_compressed_ = false;
+
+    std::string pending_;           // 等待发送的帧
+    std::string writing_;           // 正在发送的帧
+    bool writing_active_ = false;
+    bool flush_scheduled_ = false;
+
+    bool close_sent_ = false;
+    bool close_received_ = false;
+    bool failed_ = false;
+    bool finished_ = false;
+    int close_code_ = 1006;
+
+    void read();
+    void on_readable(const boost::system::error_code& ec);
+    size_t consume(char* data, size_t size);
+    void on_frame(bool fin, bool rsv1, int opcode, char* payload, size_t size);
+    void deliver(int opcode, const char* data, size_t size, bool compressed);
+
+    void enqueue(int opcode, std::string_view payload, bool compressed);
+    void schedule_flush();
+    void flush();
+
+    void send_close(int code);
+    void fail(int code);
+    void finish(int code);
+};
+
+#endif	/* WEBSOCKET_HPP */
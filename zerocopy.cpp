@@ -0,0 +1,170 @@
+#include "zerocopy.hpp"
+
+#include <cerrno>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+bool ZeroCopyWriter::usable(socket_type& socket) {
+    int fd = socket.native_handle();
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (::getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+        return false;
+    if (addr.ss_family == AF_INET) {
+        uint32_t a = ntohl(reinterpret_cast<sockaddr_in*>(&addr)->sin_addr.s_addr);
+        if ((a >> 24) == 127)
+            return false;
+    }
+    else if (addr.ss_family == AF_INET6) {
+        auto& a = reinterpret_cast<sockaddr_in6*>(&addr)->sin6_addr;
+        if (IN6_IS_ADDR_LOOPBACK(&a) || (IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == 127))
+            return false;
+    }
+    else {
+        return false;
+    }
+    int one = 1;
+    return ::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+}
+
+void ZeroCopyWriter::write(std::shared_ptr<socket_type> socket, const std::pmr::vector<boost::asio::const_buffer>& buffers, Handler handler) {
+    auto writer = std::make_shared<ZeroCopyWriter>(socket, buffers, std::move(handler));
+    // 和 async_write 一样, handler 不在调用者的栈上执行
+    boost::asio::post(writer->strand_, [writer]() {
+        writer->send();
+    });
+}
+
+ZeroCopyWriter::ZeroCopyWriter(std::shared_ptr<socket_type> socket, const std::pmr::vector<boost::asio::const_buffer>& buffers, Handler handler)
+    : socket_(std::move(socket)), strand_(boost::asio::make_strand(socket_->get_executor())), buffers_(buffers.begin(), buffers.end()), handler_(std::move(handler)) {
+}
+
+void ZeroCopyWriter::send() {
+    int fd = socket_->native_handle();
+    while (buffer_index_ < buffers_.size()) {
+        iovec iov[64];
+        size_t count = 0;
+        for (size_t i = buffer_index_, offset = offset_; i < buffers_.size() && count < 64; i++, offset = 0) {
+            iov[count].iov_base = const_cast<char*>(static_cast<const char*>(buffers_[i].data())) + offset;
+            iov[count].iov_len = buffers_[i].size() - offset;
+            count++;
+        }
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = ::sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (zerocopy_ ? MSG_ZEROCOPY : 0));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                auto self = shared_from_this();
+                socket_->async_wait(socket_type::wait_write, boost::asio::bind_executor(strand_, [self](const boost::system::error_code& ec) {
+                    if (ec) {
+                        self->error_ = ec;
+                        self->wait_completions();
+                        return;
+                    }
+                    self->send();
+                }));
+                return;
+            }
+            // 锁定的页超过了 optmem_max, 剩下的部分拷贝发送
+            if (errno == ENOBUFS && zerocopy_) {
+                zerocopy_ = false;
+                continue;
+            }
+            error_ = boost::system::error_code(errno, boost::system::system_category());
+            break;
+        }
+        if (zerocopy_)
+            sends_++;
+        sent_ += n;
+
+        size_t left = n;
+        while (buffer_index_ < buffers_.size() && left >= buffers_[buffer_index_].size() - offset_) {
+            left -= buffers_[buffer_index_].size() - offset_;
+            buffer_index_++;
+            offset_ = 0;
+        }
+        offset_ += left;
+    }
+    wait_completions();
+}
+
+void ZeroCopyWriter::wait_completions() {
+    if (read_completions()) {
+        finish();
+        return;
+    }
+
+    auto self = shared_from_this();
+    socket_->async_wait(socket_type::wait_error, boost::asio::bind_executor(strand_, [self](const boost::system::error_code& ec) {
+        if (self->finished_)
+            return;
+        if (ec && ec != boost::asio::error::operation_aborted) {
+            self->error_ = ec;
+            self->finish();
+            return;
+        }
+        self->wait_completions();
+    }));
+
+    // reactor 是边沿触发的, 登记等待之前到达的通知不会再唤醒一次, 登记以后再读一遍
+    // 先取消等待再调用 handler, handler 可能已经开始读下一个请求
+    if (read_completions()) {
+        finished_ = true;
+        boost::system::error_code ignored;
+        socket_->cancel(ignored);
+        handler_(error_, sent_);
+    }
+}
+
+bool ZeroCopyWriter::read_completions() {
+    int fd = socket_->native_handle();
+    while (completed_ < sends_) {
+        char control[128];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            // socket 已经关闭 (比如超时), 不会再有通知
+            if (!error_)
+                error_ = boost::system::error_code(errno, boost::system::system_category());
+            return true;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            auto err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // 一个通知覆盖编号 [ee_info, ee_data] 的若干次发送; 之前的响应已经等完了自己的通知, 这里收到的都属于这一次
+            completed_ += err->ee_data - err->ee_info + 1;
+        }
+    }
+    return true;
+}
+
+void ZeroCopyWriter::finish() {
+    if (finished_)
+        return;
+    finished_ = true;
+    handler_(error_, sent_);
+}
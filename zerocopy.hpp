@@ -0,0 +1,55 @@
+#ifndef ZEROCOPY_HPP
+#define	ZEROCOPY_HPP
+
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+
+// 用 MSG_ZEROCOPY 发送一个响应 (Linux 4.14+, 只支持 TCP)
+// 内核直接引用用户态的页而不拷贝进 socket 缓冲区, 直到对端确认以后才通过 socket 的错误队列通知不再引用,
+// 所以 handler 在所有数据都发出、并且收到了全部完成通知以后才调用, 在这之前 buffers 指向的数据必须保持不变。
+// HTTP/1.1 的客户端收完响应才会发下一个请求, 等待通知基本不增加延迟
+class ZeroCopyWriter : public std::enable_shared_from_this<ZeroCopyWriter> {
+public:
+    typedef boost::asio::generic::stream_protocol::socket socket_type;
+    typedef std::function<void(const boost::system::error_code&, size_t)> Handler;
+
+    // 对端是本机时数据最终还是要拷贝到接收方, 内核会退回到拷贝, 还多了锁页和通知的开销, 这时返回 false
+    // 不是 TCP 或者内核不支持 SO_ZEROCOPY 时也返回 false
+    static bool usable(socket_type& socket);
+
+    static void write(std::shared_ptr<socket_type> socket, const std::pmr::vector<boost::asio::const_buffer>& buffers, Handler handler);
+
+    ZeroCopyWriter(std::shared_ptr<socket_type> socket, const std::pmr::vector<boost::asio::const_buffer>& buffers, Handler handler);
+
+private:
+    std::shared_ptr<socket_type> socket_;
+    // 多线程运行 io_context 时, 等待可写和等待通知的回调可能同时执行, 都放到 strand 上
+    boost::asio::strand<socket_type::executor_type> strand_;
+    std::vector<boost::asio::const_buffer> buffers_;
+    Handler handler_;
+
+    size_t buffer_index_ = 0;       // 下一次从 buffers_[buffer_index_] 的 offset_ 处开始发送
+    size_t offset_ = 0;
+    size_t sent_ = 0;
+    uint32_t sends_ = 0;            // 带 MSG_ZEROCOPY 成功的 sendmsg 次数, 每次对应一个完成通知
+    uint32_t completed_ = 0;
+    bool zerocopy_ = true;          // 超过 optmem_max 时 (ENOBUFS) 剩下的部分改为普通发送
+    bool finished_ = false;
+    boost::system::error_code error_;
+
+    void send();
+
+    void wait_completions();
+
+    // 读取错误队列中的完成通知, 返回是否已经全部完成
+    bool read_completions();
+
+    void finish();
+};
+
+#endif	/* ZEROCOPY_HPP */